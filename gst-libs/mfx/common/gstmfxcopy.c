@@ -0,0 +1,172 @@
+/*
+ *  gstmfxcopy.c - plane copy helpers
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#include "gstmfxcopy.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define HAVE_SSE41_COPY 1
+# define SSE41_FUNC __attribute__ ((target ("sse4.1")))
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+# define HAVE_SSE41_COPY 1
+# define SSE41_FUNC
+# include <intrin.h>
+#endif
+
+#ifdef HAVE_SSE41_COPY
+# include <smmintrin.h>
+
+/* Small enough to stay in L1 between the load and the store passes */
+#define BOUNCE_SIZE 4096
+
+/* Video memory mappings are usually uncached or write-combined, where
+ * regular loads are extremely slow. MOVNTDQA fetches whole 64 byte lines
+ * from such memory into streaming load buffers, so the source is first
+ * read in line sized bursts into a cached bounce buffer, which then gets
+ * copied to the destination with regular stores */
+static SSE41_FUNC void
+copy_row_sse41 (guint8 * dst, const guint8 * src, guint size,
+    __m128i * bounce)
+{
+  guint head, n, i;
+
+  head = (16 - ((guintptr) src & 15)) & 15;
+  if (head) {
+    head = MIN (head, size);
+    memcpy (dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+  }
+
+  while (size >= 16) {
+    const __m128i *s = (const __m128i *) src;
+
+    n = MIN (size, BOUNCE_SIZE) & ~15;
+    for (i = 0; i + 64 <= n; i += 64, s += 4) {
+      __m128i x0 = _mm_stream_load_si128 ((__m128i *) s + 0);
+      __m128i x1 = _mm_stream_load_si128 ((__m128i *) s + 1);
+      __m128i x2 = _mm_stream_load_si128 ((__m128i *) s + 2);
+      __m128i x3 = _mm_stream_load_si128 ((__m128i *) s + 3);
+
+      _mm_store_si128 (bounce + i / 16 + 0, x0);
+      _mm_store_si128 (bounce + i / 16 + 1, x1);
+      _mm_store_si128 (bounce + i / 16 + 2, x2);
+      _mm_store_si128 (bounce + i / 16 + 3, x3);
+    }
+    for (; i < n; i += 16, s++)
+      _mm_store_si128 (bounce + i / 16,
+          _mm_stream_load_si128 ((__m128i *) s));
+
+    memcpy (dst, bounce, n);
+    dst += n;
+    src += n;
+    size -= n;
+  }
+
+  if (size)
+    memcpy (dst, src, size);
+}
+
+static SSE41_FUNC void
+copy_plane_sse41 (guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint row_size, guint height)
+{
+  __m128i bounce[BOUNCE_SIZE / 16];
+  guint i;
+
+  /* Order the streaming loads after any prior writes to the source */
+  _mm_mfence ();
+
+  for (i = 0; i < height; i++) {
+    copy_row_sse41 (dst, src, row_size, bounce);
+    dst += dst_stride;
+    src += src_stride;
+  }
+}
+
+static gpointer
+detect_sse41 (gpointer data)
+{
+  gboolean has_sse41;
+
+#ifdef _MSC_VER
+  int info[4];
+
+  __cpuid (info, 1);
+  has_sse41 = (info[2] & (1 << 19)) != 0;
+#else
+  __builtin_cpu_init ();
+  has_sse41 = __builtin_cpu_supports ("sse4.1") != 0;
+#endif
+  return GINT_TO_POINTER (has_sse41);
+}
+#endif
+
+gboolean
+gst_mfx_copy_has_streaming_load (void)
+{
+#ifdef HAVE_SSE41_COPY
+  static GOnce once = G_ONCE_INIT;
+
+  g_once (&once, detect_sse41, NULL);
+  return GPOINTER_TO_INT (once.retval);
+#else
+  return FALSE;
+#endif
+}
+
+void
+gst_mfx_copy_plane_memcpy (guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint row_size, guint height)
+{
+  guint i;
+
+  if (src_stride == dst_stride && src_stride == row_size) {
+    memcpy (dst, src, (gsize) row_size * height);
+    return;
+  }
+
+  for (i = 0; i < height; i++) {
+    memcpy (dst, src, row_size);
+    dst += dst_stride;
+    src += src_stride;
+  }
+}
+
+/* Copies @height rows of @row_size bytes, using streaming loads when the
+ * CPU supports them. Meant for reading back mapped video memory, but
+ * works on any memory */
+void
+gst_mfx_copy_plane (guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint row_size, guint height)
+{
+#ifdef HAVE_SSE41_COPY
+  if (gst_mfx_copy_has_streaming_load ()) {
+    if (src_stride == dst_stride && src_stride == row_size) {
+      row_size *= height;
+      height = 1;
+    }
+    copy_plane_sse41 (dst, dst_stride, src, src_stride, row_size, height);
+    return;
+  }
+#endif
+  gst_mfx_copy_plane_memcpy (dst, dst_stride, src, src_stride, row_size,
+      height);
+}
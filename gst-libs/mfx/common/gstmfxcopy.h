@@ -0,0 +1,39 @@
+/*
+ *  gstmfxcopy.h - plane copy helpers
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#ifndef GST_MFX_COPY_H
+#define GST_MFX_COPY_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean
+gst_mfx_copy_has_streaming_load (void);
+
+void
+gst_mfx_copy_plane (guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint row_size, guint height);
+
+void
+gst_mfx_copy_plane_memcpy (guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint row_size, guint height);
+
+G_END_DECLS
+#endif /* GST_MFX_COPY_H */
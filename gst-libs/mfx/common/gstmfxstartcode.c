@@ -0,0 +1,163 @@
+/*
+ *  gstmfxstartcode.c - Annex B start code scanner
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#include "gstmfxstartcode.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define HAVE_SIMD_SCAN 1
+# define SSE2_FUNC __attribute__ ((target ("sse2")))
+# define AVX2_FUNC __attribute__ ((target ("avx2")))
+# define ctz(x) __builtin_ctz (x)
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+# define HAVE_SIMD_SCAN 1
+# define SSE2_FUNC
+# define AVX2_FUNC
+# include <intrin.h>
+static __forceinline guint
+ctz (guint x)
+{
+  unsigned long i;
+
+  _BitScanForward (&i, x);
+  return i;
+}
+#endif
+
+typedef gsize (*FindStartCodeFunc) (const guint8 * data, gsize size);
+
+/* Returns the offset of the first 00 00 01 prefix in @data, or @size if
+ * there is none. A four byte start code is found one byte past its
+ * leading zero, which callers check for themselves */
+gsize
+gst_mfx_find_start_code_scalar (const guint8 * data, gsize size)
+{
+  gsize i;
+
+  for (i = 0; i + 2 < size; i++) {
+    /* No prefix can end on a byte above 1, so skip past it */
+    if (data[i + 2] > 1)
+      i += 2;
+    else if (!data[i] && !data[i + 1] && data[i + 2] == 1)
+      return i;
+  }
+  return size;
+}
+
+#ifdef HAVE_SIMD_SCAN
+# include <emmintrin.h>
+# include <immintrin.h>
+
+/* Both vector scans compare each of the three prefix bytes against a
+ * shifted load of the block, so every lane whose bitmask survives the
+ * ANDs starts a prefix */
+static SSE2_FUNC gsize
+find_start_code_sse2 (const guint8 * data, gsize size)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i one = _mm_set1_epi8 (1);
+  gsize i = 0;
+  guint mask;
+
+  for (; i + 18 <= size; i += 16) {
+    __m128i b0 = _mm_loadu_si128 ((const __m128i *) (data + i));
+    __m128i b1 = _mm_loadu_si128 ((const __m128i *) (data + i + 1));
+    __m128i b2 = _mm_loadu_si128 ((const __m128i *) (data + i + 2));
+
+    /* Most blocks hold no pair of zero bytes at all */
+    mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (b0, zero),
+            _mm_cmpeq_epi8 (b1, zero)));
+    if (!mask)
+      continue;
+    mask &= _mm_movemask_epi8 (_mm_cmpeq_epi8 (b2, one));
+    if (mask)
+      return i + ctz (mask);
+  }
+
+  return i + gst_mfx_find_start_code_scalar (data + i, size - i);
+}
+
+static AVX2_FUNC gsize
+find_start_code_avx2 (const guint8 * data, gsize size)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i one = _mm256_set1_epi8 (1);
+  gsize i = 0;
+  guint mask;
+
+  for (; i + 34 <= size; i += 32) {
+    __m256i b0 = _mm256_loadu_si256 ((const __m256i *) (data + i));
+    __m256i b1 = _mm256_loadu_si256 ((const __m256i *) (data + i + 1));
+    __m256i b2 = _mm256_loadu_si256 ((const __m256i *) (data + i + 2));
+
+    mask = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_cmpeq_epi8 (b0,
+                zero), _mm256_cmpeq_epi8 (b1, zero)));
+    if (!mask)
+      continue;
+    mask &= _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (b2, one));
+    if (mask)
+      return i + ctz (mask);
+  }
+
+  return i + find_start_code_sse2 (data + i, size - i);
+}
+
+static gpointer
+select_find_start_code (gpointer data)
+{
+  gboolean has_avx2, has_sse2;
+
+#ifdef _MSC_VER
+  int info[4];
+
+  __cpuid (info, 1);
+  has_sse2 = (info[3] & (1 << 26)) != 0;
+  /* AVX2 also needs OS support for saving the YMM registers */
+  has_avx2 = (info[2] & (1 << 27)) != 0 && (_xgetbv (0) & 6) == 6;
+  if (has_avx2) {
+    __cpuidex (info, 7, 0);
+    has_avx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init ();
+  has_sse2 = __builtin_cpu_supports ("sse2") != 0;
+  has_avx2 = __builtin_cpu_supports ("avx2") != 0;
+#endif
+
+  if (has_avx2)
+    return find_start_code_avx2;
+  if (has_sse2)
+    return find_start_code_sse2;
+  return gst_mfx_find_start_code_scalar;
+}
+#endif
+
+/* Same as gst_mfx_find_start_code_scalar (), using the widest vector scan
+ * the CPU supports */
+gsize
+gst_mfx_find_start_code (const guint8 * data, gsize size)
+{
+#ifdef HAVE_SIMD_SCAN
+  static GOnce once = G_ONCE_INIT;
+
+  g_once (&once, select_find_start_code, NULL);
+  return ((FindStartCodeFunc) once.retval) (data, size);
+#else
+  return gst_mfx_find_start_code_scalar (data, size);
+#endif
+}
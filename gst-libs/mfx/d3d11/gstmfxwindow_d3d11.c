@@ -200,12 +200,10 @@ gst_mfx_window_d3d11_render (GstMfxWindow * window, GstMfxSurface * surface,
           (priv2->mapped_surface), MFX_SURFACE_WRITE);
     }
 
-    if (!gst_mfx_surface_map (priv2->mapped_surface))
+    if (!gst_mfx_surface_map (priv2->mapped_surface, GST_MAP_WRITE))
       return FALSE;
 
-    memcpy (gst_mfx_surface_get_plane (priv2->mapped_surface, 0),
-        gst_mfx_surface_get_plane (surface, 0),
-        gst_mfx_surface_get_data_size (surface));
+    gst_mfx_surface_copy_data (priv2->mapped_surface, surface);
 
     gst_mfx_surface_unmap (priv2->mapped_surface);
   }
@@ -60,6 +60,8 @@ struct _GstMfxCompositeFilter
   mfxExtBuffer *ext_buffer;
   mfxExtVPPComposite composite;
   guint num_rect;
+
+  GstMfxDeviceBusy busy;
 };
 
 G_DEFINE_TYPE (GstMfxCompositeFilter, gst_mfx_composite_filter, GST_TYPE_OBJECT)
@@ -360,8 +362,10 @@ gst_mfx_composite_filter_apply_composition (GstMfxCompositeFilter * filter,
         insurf, outsurf, NULL, &syncp);
 
     if (MFX_WRN_DEVICE_BUSY == sts)
-      g_usleep (100);
+      gst_mfx_task_aggregator_wait_device_busy (filter->aggregator,
+          &filter->busy, NULL, NULL);
   } while (MFX_WRN_DEVICE_BUSY == sts);
+  gst_mfx_device_busy_reset (&filter->busy);
 
   if (MFX_ERR_MORE_DATA == sts) {
     for (i = 0; i < num_subpictures; i++) {
@@ -374,8 +378,10 @@ gst_mfx_composite_filter_apply_composition (GstMfxCompositeFilter * filter,
             insurf, outsurf, NULL, &syncp);
 
         if (MFX_WRN_DEVICE_BUSY == sts)
-          g_usleep (500);
+          gst_mfx_task_aggregator_wait_device_busy (filter->aggregator,
+              &filter->busy, NULL, NULL);
       } while (MFX_WRN_DEVICE_BUSY == sts);
+      gst_mfx_device_busy_reset (&filter->busy);
     }
   }
 
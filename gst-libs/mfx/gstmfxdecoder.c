@@ -26,10 +26,23 @@
 #include "gstmfxsurfacepool.h"
 #include "gstmfxsurface.h"
 #include "gstmfxtask.h"
+#include "common/gstmfxstartcode.h"
 
 #define DEBUG 1
 #include "gstmfxdebug.h"
 
+/* Contiguous bitstream storage. Consumed data is only dropped from the
+ * front, and pending data is moved back to the start of the storage when
+ * there is no room left for appending */
+typedef struct _GstMfxDecoderBitstream GstMfxDecoderBitstream;
+struct _GstMfxDecoderBitstream
+{
+  guint8 *data;
+  guint offset;
+  guint len;
+  guint size;
+};
+
 struct _GstMfxDecoder
 {
   /*< private > */
@@ -40,18 +53,28 @@ struct _GstMfxDecoder
   GstMfxProfile profile;
   GstMfxSurfacePool *pool;
   GstMfxFilter *filter;
-  GByteArray *bitstream;
+  GstMfxDecoderBitstream bitstream;
   GByteArray *codec_data;
+  /* Size of the NAL length prefixes of avc / hvc1 input, 0 for Annex B */
+  guint nal_length_size;
+
+  /* Input accumulated while looking for stream headers */
+  GstMfxDecoderBitstream probe;
+  guint num_probed_frames;
 
   GQueue input_frames;
   GQueue decoded_frames;
-  GQueue pending_frames;
+  GPtrArray *pending_frames;
   GQueue discarded_frames;
+  /* Output surfaces handed out with a syncpoint, oldest first and up to
+   * AsyncDepth of them, which may still be in flight */
+  GQueue sync_surfaces;
 
   mfxSession session;
   mfxVideoParam params;
   mfxFrameAllocRequest request;
   mfxBitstream bs;
+  mfxU16 bs_data_flag;
   const mfxPluginUID *plugin_uid;
 
   GstVideoInfo info;
@@ -66,6 +89,7 @@ struct _GstMfxDecoder
   guint num_partial_frames;
   guint initial_frame_latency;
   guint num_frame_latency;
+  GstMfxDeviceBusy busy;
 
   /* For special double frame rate deinterlacing case */
   GstClockTime current_pts;
@@ -75,6 +99,142 @@ struct _GstMfxDecoder
 
 G_DEFINE_TYPE (GstMfxDecoder, gst_mfx_decoder, GST_TYPE_OBJECT);
 
+static inline guint8 *
+bitstream_get_data (GstMfxDecoderBitstream * bitstream)
+{
+  return bitstream->data ? bitstream->data + bitstream->offset : NULL;
+}
+
+/* Returns a pointer to at least @size writable bytes after pending data */
+static guint8 *
+bitstream_reserve (GstMfxDecoderBitstream * bitstream, guint size)
+{
+  if (bitstream->offset + bitstream->len + size > bitstream->size) {
+    if (bitstream->offset) {
+      memmove (bitstream->data, bitstream->data + bitstream->offset,
+          bitstream->len);
+      bitstream->offset = 0;
+    }
+    if (bitstream->len + size > bitstream->size) {
+      bitstream->size = MAX (2 * bitstream->size, bitstream->len + size);
+      bitstream->data = g_realloc (bitstream->data, bitstream->size);
+    }
+  }
+  return bitstream->data + bitstream->offset + bitstream->len;
+}
+
+static void
+bitstream_append (GstMfxDecoderBitstream * bitstream, const guint8 * data,
+    guint size)
+{
+  memcpy (bitstream_reserve (bitstream, size), data, size);
+  bitstream->len += size;
+}
+
+static inline guint
+read_nal_length (const guint8 * data, guint nal_length_size)
+{
+  switch (nal_length_size) {
+    case 1:
+      return data[0];
+    case 2:
+      return GST_READ_UINT16_BE (data);
+    case 3:
+      return GST_READ_UINT24_BE (data);
+    default:
+      return GST_READ_UINT32_BE (data);
+  }
+}
+
+/* Appends length prefixed NALs, turning each prefix into a start code
+ * while copying. The output is sized first so that it is reserved at
+ * once. Returns FALSE on a truncated NAL, leaving @bitstream untouched */
+static gboolean
+bitstream_append_packetized (GstMfxDecoderBitstream * bitstream,
+    const guint8 * data, guint size, guint nal_length_size)
+{
+  guint pos, len, out_size = 0;
+  guint8 *out;
+
+  for (pos = 0; pos < size; pos += len) {
+    if (size - pos < nal_length_size)
+      return FALSE;
+    len = read_nal_length (data + pos, nal_length_size);
+    pos += nal_length_size;
+    if (len > size - pos)
+      return FALSE;
+    out_size += 4 + len;
+  }
+
+  out = bitstream_reserve (bitstream, out_size);
+  for (pos = 0; pos < size; pos += len) {
+    len = read_nal_length (data + pos, nal_length_size);
+    pos += nal_length_size;
+    out[0] = out[1] = out[2] = 0;
+    out[3] = 1;
+    memcpy (out + 4, data + pos, len);
+    out += 4 + len;
+  }
+  bitstream->len += out_size;
+  return TRUE;
+}
+
+/* Drops @size bytes of consumed data from the front */
+static void
+bitstream_flush (GstMfxDecoderBitstream * bitstream, guint size)
+{
+  size = MIN (size, bitstream->len);
+  bitstream->offset += size;
+  bitstream->len -= size;
+  if (!bitstream->len)
+    bitstream->offset = 0;
+}
+
+static inline void
+bitstream_clear (GstMfxDecoderBitstream * bitstream)
+{
+  bitstream->offset = bitstream->len = 0;
+}
+
+/* Clears the mfxBitstream, keeping flags set at creation time */
+static void
+reset_bitstream (GstMfxDecoder * decoder)
+{
+  memset (&decoder->bs, 0, sizeof (mfxBitstream));
+  decoder->bs.DataFlag = decoder->bs_data_flag;
+}
+
+/* Appends input data as Annex B, which is all MSDK parses */
+static void
+append_input (GstMfxDecoder * decoder, GstMfxDecoderBitstream * bitstream,
+    const guint8 * data, guint size)
+{
+  if (!decoder->nal_length_size)
+    bitstream_append (bitstream, data, size);
+  else if (!bitstream_append_packetized (bitstream, data, size,
+          decoder->nal_length_size))
+    GST_WARNING ("Dropping malformed packetized input of %u bytes", size);
+}
+
+/* Input memory fed directly to the decoder becomes invalid once unmapped,
+ * so copy whatever was not consumed yet into the bitstream storage */
+static void
+detach_input_memory (GstMfxDecoder * decoder, GstMapInfo * minfo)
+{
+  mfxBitstream *const bs = &decoder->bs;
+
+  if (!minfo->data || bs->Data != minfo->data)
+    return;
+
+  bitstream_clear (&decoder->bitstream);
+  if (bs->DataLength)
+    bitstream_append (&decoder->bitstream, bs->Data + bs->DataOffset,
+        bs->DataLength);
+  bs->Data = bitstream_get_data (&decoder->bitstream);
+  bs->DataOffset = 0;
+  bs->MaxLength = bs->DataLength;
+}
+
 void
 gst_mfx_decoder_update_video_info (GstMfxDecoder * decoder,
     const GstVideoInfo * info)
@@ -131,6 +291,25 @@ gst_mfx_decoder_skip_corrupted_frames (GstMfxDecoder * decoder)
   decoder->skip_corrupted_frames = TRUE;
 }
 
+/* Marks the input as packetized NAL units. Streams carrying parameter
+ * sets in-band (avc3 / hev1) default to 4-byte NAL lengths when there is
+ * no configuration record, avc / hvc1 streams must come with one */
+gboolean
+gst_mfx_decoder_set_packetized (GstMfxDecoder * decoder,
+    gboolean headers_in_band)
+{
+  g_return_val_if_fail (decoder != NULL, FALSE);
+
+  if (decoder->nal_length_size)
+    return TRUE;
+  if (!headers_in_band) {
+    GST_ERROR ("Packetized stream without a valid configuration record");
+    return FALSE;
+  }
+  decoder->nal_length_size = 4;
+  return TRUE;
+}
+
 void
 gst_mfx_decoder_set_output_memtype (GstMfxDecoder * decoder,
     gboolean memtype_is_system)
@@ -162,9 +341,161 @@ init_decoder (GstMfxDecoder * decoder)
   return TRUE;
 }
 
+/* Pending frames form a binary min-heap on PTS, so that matching decoded
+ * surfaces with their frames stays logarithmic whatever the reordering
+ * depth. Frames with equal PTS come out in decoding order */
+static inline gboolean
+frame_before (GstVideoCodecFrame * a, GstVideoCodecFrame * b)
+{
+  if (a->pts != b->pts)
+    return a->pts < b->pts;
+  return a->system_frame_number < b->system_frame_number;
+}
+
+static void
+pending_frames_push (GstMfxDecoder * decoder, GstVideoCodecFrame * frame)
+{
+  GPtrArray *const heap = decoder->pending_frames;
+  guint i = heap->len, parent;
+
+  g_ptr_array_add (heap, frame);
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (!frame_before (frame, g_ptr_array_index (heap, parent)))
+      break;
+    heap->pdata[i] = heap->pdata[parent];
+    i = parent;
+  }
+  heap->pdata[i] = frame;
+}
+
+static GstVideoCodecFrame *
+pending_frames_pop (GstMfxDecoder * decoder)
+{
+  GPtrArray *const heap = decoder->pending_frames;
+  GstVideoCodecFrame *top, *last;
+  guint i = 0, child;
+
+  if (!heap->len)
+    return NULL;
+
+  top = g_ptr_array_index (heap, 0);
+  last = g_ptr_array_remove_index (heap, heap->len - 1);
+  if (!heap->len)
+    return top;
+
+  while ((child = 2 * i + 1) < heap->len) {
+    if (child + 1 < heap->len
+        && frame_before (heap->pdata[child + 1], heap->pdata[child]))
+      child++;
+    if (!frame_before (heap->pdata[child], last))
+      break;
+    heap->pdata[i] = heap->pdata[child];
+    i = child;
+  }
+  heap->pdata[i] = last;
+  return top;
+}
+
+/* Moves all pending frames to the discarded ones, earliest PTS first */
+static void
+discard_pending_frames (GstMfxDecoder * decoder)
+{
+  GQueue frames = G_QUEUE_INIT;
+  GstVideoCodecFrame *frame;
+
+  while (!!(frame = pending_frames_pop (decoder)))
+    g_queue_push_head (&frames, frame);
+  while (!!(frame = g_queue_pop_head (&frames)))
+    g_queue_push_head (&decoder->discarded_frames, frame);
+}
+
+/* Discards the earliest frames that only carried part of a picture, which
+ * is how MFX reports fields or slices it merged into a single surface */
+static void
+discard_partial_frames (GstMfxDecoder * decoder)
+{
+  GQueue kept = G_QUEUE_INIT;
+  GstVideoCodecFrame *frame;
+
+  while (decoder->num_partial_frames
+      && !!(frame = pending_frames_pop (decoder))) {
+    if ((frame->pts - decoder->pts_offset) % decoder->duration) {
+      g_queue_push_head (&decoder->discarded_frames, frame);
+      decoder->num_partial_frames--;
+    } else {
+      g_queue_push_tail (&kept, frame);
+    }
+  }
+  while (!!(frame = g_queue_pop_head (&kept)))
+    pending_frames_push (decoder, frame);
+}
+
+/* Drops the oldest outputs once waited on, by downstream or the decoder */
+static void
+prune_sync_surfaces (GstMfxDecoder * decoder)
+{
+  GstMfxSurface *surface;
+
+  while (!!(surface = g_queue_peek_head (&decoder->sync_surfaces))
+      && !gst_mfx_surface_has_pending_sync (surface))
+    gst_mfx_surface_unref (g_queue_pop_head (&decoder->sync_surfaces));
+}
+
+/* Waits on the oldest in-flight decode operation, also used while the
+ * device is busy */
+static gboolean
+sync_oldest_surface (gpointer data)
+{
+  GstMfxDecoder *const decoder = data;
+  GstMfxSurface *surface;
+  gboolean synced;
+
+  prune_sync_surfaces (decoder);
+  surface = g_queue_pop_head (&decoder->sync_surfaces);
+  if (!surface)
+    return FALSE;
+
+  synced = gst_mfx_surface_sync (surface);
+  gst_mfx_surface_unref (surface);
+  return synced;
+}
+
+/* Decode of the next frames overlaps with the output of this one, until
+ * AsyncDepth frames are in flight */
+static void
+push_sync_surface (GstMfxDecoder * decoder, GstMfxSurface * surface)
+{
+  prune_sync_surfaces (decoder);
+  if (g_queue_get_length (&decoder->sync_surfaces) >=
+      MAX (decoder->params.AsyncDepth, 1))
+    sync_oldest_surface (decoder);
+  g_queue_push_tail (&decoder->sync_surfaces, gst_mfx_surface_ref (surface));
+}
+
+/* Waits on every in-flight operation, then forgets the syncpoints of all
+ * surfaces handed out, downstream may hold them past a reset or close of
+ * the session. Decode operations complete in submission order, so
+ * waiting on the newest one is enough */
+static void
+wait_decoded_surfaces (GstMfxDecoder * decoder)
+{
+  GstMfxSurface *const surface = g_queue_peek_tail (&decoder->sync_surfaces);
+
+  if (surface)
+    gst_mfx_surface_sync (surface);
+  g_queue_foreach (&decoder->sync_surfaces, (GFunc) gst_mfx_surface_unref,
+      NULL);
+  g_queue_clear (&decoder->sync_surfaces);
+
+  if (decoder->pool)
+    gst_mfx_surface_pool_clear_sync_points (decoder->pool);
+}
+
 static void
 close_decoder (GstMfxDecoder * decoder)
 {
+  wait_decoded_surfaces (decoder);
   gst_mfx_surface_pool_replace (&decoder->pool, NULL);
   /* Make sure frame allocator points to the right task to free surfaces */
   gst_mfx_task_aggregator_set_current_task (decoder->aggregator,
@@ -178,18 +509,19 @@ gst_mfx_decoder_finalize (GObject * object)
 {
   GstMfxDecoder *decoder = GST_MFX_DECODER (object);
 
-  g_byte_array_unref (decoder->bitstream);
+  g_free (decoder->bitstream.data);
+  g_free (decoder->probe.data);
   if (decoder->codec_data)
     g_byte_array_unref (decoder->codec_data);
 
   g_queue_foreach (&decoder->input_frames,
       (GFunc) gst_video_codec_frame_unref, NULL);
-  g_queue_foreach (&decoder->pending_frames,
+  g_ptr_array_foreach (decoder->pending_frames,
       (GFunc) gst_video_codec_frame_unref, NULL);
   g_queue_foreach (&decoder->decoded_frames,
       (GFunc) gst_video_codec_frame_unref, NULL);
   g_queue_clear (&decoder->input_frames);
-  g_queue_clear (&decoder->pending_frames);
+  g_ptr_array_unref (decoder->pending_frames);
   g_queue_clear (&decoder->decoded_frames);
   g_queue_clear (&decoder->discarded_frames);
 
@@ -319,6 +651,68 @@ error_load_plugin:
   }
 }
 
+/* Converts an avcC / hvcC decoder configuration record into Annex B
+ * parameter sets. Returns NULL if @data is not such a record */
+static GByteArray *
+codec_data_to_annexb (mfxU32 codec, const guint8 * data, guint size)
+{
+  static const guint8 start_code[] = { 0, 0, 0, 1 };
+  GByteArray *out;
+  guint pos, num_arrays, num_nals, len, i, j;
+
+  if (size < 7 || data[0] != 1)
+    return NULL;
+
+  switch (codec) {
+    case MFX_CODEC_AVC:
+      /* SPS then PPS, each preceded by its count */
+      pos = 5;
+      num_arrays = 2;
+      break;
+    case MFX_CODEC_HEVC:
+      if (size < 23)
+        return NULL;
+      pos = 23;
+      num_arrays = data[22];
+      break;
+    default:
+      return NULL;
+  }
+
+  out = g_byte_array_new ();
+  for (i = 0; i < num_arrays; i++) {
+    if (MFX_CODEC_HEVC == codec) {
+      if (pos + 3 > size)
+        goto error;
+      num_nals = GST_READ_UINT16_BE (data + pos + 1);
+      pos += 3;
+    } else {
+      if (pos + 1 > size)
+        goto error;
+      num_nals = i ? data[pos] : data[pos] & 0x1f;
+      pos++;
+    }
+
+    for (j = 0; j < num_nals; j++) {
+      if (pos + 2 > size)
+        goto error;
+      len = GST_READ_UINT16_BE (data + pos);
+      pos += 2;
+      if (pos + len > size)
+        goto error;
+      g_byte_array_append (out, start_code, sizeof (start_code));
+      g_byte_array_append (out, data + pos, len);
+      pos += len;
+    }
+  }
+  return out;
+
+error:
+  GST_WARNING ("Truncated decoder configuration record");
+  g_byte_array_unref (out);
+  return NULL;
+}
+
 static gboolean
 gst_mfx_decoder_create (GstMfxDecoder * decoder,
     GstMfxTaskAggregator * aggregator, GstMfxProfile profile,
@@ -332,32 +726,32 @@ gst_mfx_decoder_create (GstMfxDecoder * decoder,
   decoder->params.AsyncDepth = async_depth;
   if (live_mode) {
     decoder->params.AsyncDepth = 1;
-    decoder->bs.DataFlag = MFX_BITSTREAM_COMPLETE_FRAME;
+    decoder->bs_data_flag = MFX_BITSTREAM_COMPLETE_FRAME;
     /* Hack for H264 low-latency streaming */
     if (decoder->params.mfx.CodecId == MFX_CODEC_AVC)
       decoder->params.mfx.DecodedOrder = 1;
   }
   decoder->params.IOPattern = MFX_IOPATTERN_OUT_VIDEO_MEMORY;
-  decoder->bitstream = g_byte_array_new ();
-  if (!decoder->bitstream)
-    return FALSE;
+  reset_bitstream (decoder);
 
   if (codec_data) {
-    decoder->codec_data = g_byte_array_sized_new (codec_data->len);
-    decoder->codec_data = g_byte_array_append (decoder->codec_data,
+    decoder->codec_data = codec_data_to_annexb (profile.codec,
         codec_data->data, codec_data->len);
+    /* A configuration record means packetized input */
+    if (decoder->codec_data)
+      decoder->nal_length_size = (codec_data->data[MFX_CODEC_AVC ==
+              profile.codec ? 4 : 21] & 3) + 1;
+    else {
+      decoder->codec_data = g_byte_array_sized_new (codec_data->len);
+      decoder->codec_data = g_byte_array_append (decoder->codec_data,
+          codec_data->data, codec_data->len);
+    }
   }
 
   decoder->aggregator = gst_mfx_task_aggregator_ref (aggregator);
   if (!task_init (decoder))
-    goto error_init_task;
-  return TRUE;
-
-error_init_task:
-  {
-    g_byte_array_unref (decoder->bitstream);
     return FALSE;
-  }
+  return TRUE;
 }
 
 static void
@@ -369,8 +763,9 @@ gst_mfx_decoder_init (GstMfxDecoder * decoder)
 
   g_queue_init (&decoder->input_frames);
   g_queue_init (&decoder->decoded_frames);
-  g_queue_init (&decoder->pending_frames);
+  decoder->pending_frames = g_ptr_array_new ();
   g_queue_init (&decoder->discarded_frames);
+  g_queue_init (&decoder->sync_surfaces);
 }
 
 static void
@@ -489,7 +884,7 @@ error:
 }
 
 static GstMfxDecoderStatus
-gst_mfx_decoder_start (GstMfxDecoder * decoder)
+start_decoder (GstMfxDecoder * decoder)
 {
   if (!decoder->filter
       && gst_mfx_task_get_task_type (decoder->decode) == GST_MFX_TASK_DECODER) {
@@ -518,56 +913,149 @@ gst_mfx_decoder_start (GstMfxDecoder * decoder)
   return GST_MFX_DECODER_STATUS_SUCCESS;
 }
 
+/* Whether the start code prefixed unit beginning with @header opens the
+ * parameter sets MFXVideoDECODE_DecodeHeader() needs */
+static gboolean
+is_parameter_set (GstMfxDecoder * decoder, guint8 header)
+{
+  switch (decoder->profile.codec) {
+    case MFX_CODEC_AVC:
+      return (header & 0x1f) == 7;
+    case MFX_CODEC_HEVC:{
+      guint type = (header >> 1) & 0x3f;
+      /* VPS or SPS */
+      return type == 32 || type == 33;
+    }
+    case MFX_CODEC_MPEG2:
+      return header == 0xb3;
+    default:
+      return TRUE;
+  }
+}
+
+static inline gboolean
+probe_uses_start_codes (GstMfxDecoder * decoder)
+{
+  return MFX_CODEC_AVC == decoder->profile.codec
+      || MFX_CODEC_HEVC == decoder->profile.codec
+      || MFX_CODEC_MPEG2 == decoder->profile.codec;
+}
+
+/* Appends input frames queued since the last probe, mapping each once */
+static gboolean
+probe_append_input (GstMfxDecoder * decoder)
+{
+  GList *l = g_queue_peek_tail_link (&decoder->input_frames);
+  guint n = g_queue_get_length (&decoder->input_frames);
+  GstVideoCodecFrame *frame;
+  GstMapInfo minfo;
+
+  if (n <= decoder->num_probed_frames)
+    return TRUE;
+
+  /* New frames sit at the tail */
+  for (n -= decoder->num_probed_frames; n > 1; n--)
+    l = l->prev;
+
+  for (; l; l = l->next) {
+    frame = l->data;
+    if (!gst_buffer_map (frame->input_buffer, &minfo, GST_MAP_READ)) {
+      GST_ERROR ("Failed to map input buffer");
+      return FALSE;
+    }
+    append_input (decoder, &decoder->probe, minfo.data, minfo.size);
+    gst_buffer_unmap (frame->input_buffer, &minfo);
+    decoder->num_probed_frames++;
+  }
+  return TRUE;
+}
+
+/* Drops probed data up to the first parameter set. Without one, only the
+ * last bytes are kept in case a start code straddles two buffers, so data
+ * is scanned once however late the headers show up */
+static gboolean
+probe_skip_to_parameter_set (GstMfxDecoder * decoder)
+{
+  GstMfxDecoderBitstream *const probe = &decoder->probe;
+  const guint8 *data = bitstream_get_data (probe);
+  gsize i = 0;
+
+  while (i + 3 < probe->len) {
+    i += gst_mfx_find_start_code (data + i, probe->len - i);
+    if (i + 3 >= probe->len)
+      break;
+    if (is_parameter_set (decoder, data[i + 3])) {
+      bitstream_flush (probe, i);
+      return TRUE;
+    }
+    i += 3;
+  }
+
+  if (probe->len > 3)
+    bitstream_flush (probe, probe->len - 3);
+  return FALSE;
+}
+
+static void
+probe_clear (GstMfxDecoder * decoder)
+{
+  g_free (decoder->probe.data);
+  memset (&decoder->probe, 0, sizeof (decoder->probe));
+  decoder->num_probed_frames = 0;
+}
+
 static GstMfxDecoderStatus
 gst_mfx_decoder_prepare (GstMfxDecoder * decoder)
 {
   GstMfxDecoderStatus ret = GST_MFX_DECODER_STATUS_CONFIGURED;
-  GstVideoCodecFrame *cur_frame = NULL;
-  GstMapInfo minfo = { 0 };
-  guint i = 0;
   mfxStatus sts = MFX_ERR_NONE;
 
-  do {
-    if (MFX_CODEC_VC1 == decoder->profile.codec
-        && MFX_PROFILE_VC1_ADVANCED == decoder->profile.profile) {
-      decoder->bitstream = g_byte_array_append (decoder->bitstream,
-          decoder->codec_data->data, decoder->codec_data->len);
-      decoder->bs.Data = decoder->bitstream->data;
-      decoder->bs.DataLength = decoder->codec_data->len;
-      decoder->bs.MaxLength = decoder->bs.DataLength;
-    } else {
-      cur_frame = g_queue_peek_nth (&decoder->input_frames, i++);
-      if (!cur_frame)
-        return GST_MFX_DECODER_STATUS_ERROR_MORE_DATA;
-      if (!gst_buffer_map (cur_frame->input_buffer, &minfo, GST_MAP_READ)) {
-        GST_ERROR ("Failed to map input buffer");
-        return GST_MFX_DECODER_STATUS_ERROR_UNKNOWN;
-      }
-
-      if (minfo.size) {
-        decoder->bs.DataLength = decoder->bs.MaxLength = minfo.size;
-        decoder->bs.DataOffset = 0;
-        decoder->bs.Data = minfo.data;
-      }
-    }
+  if (MFX_CODEC_VC1 == decoder->profile.codec
+      && MFX_PROFILE_VC1_ADVANCED == decoder->profile.profile) {
+    bitstream_append (&decoder->bitstream,
+        decoder->codec_data->data, decoder->codec_data->len);
+    decoder->bs.Data = bitstream_get_data (&decoder->bitstream);
+    decoder->bs.DataLength = decoder->codec_data->len;
+    decoder->bs.MaxLength = decoder->bs.DataLength;
 
     sts = MFXVideoDECODE_DecodeHeader (decoder->session, &decoder->bs,
         &decoder->params);
-    if (MFX_ERR_NONE == sts) {
-      ret = GST_MFX_DECODER_STATUS_CONFIGURED;
-      break;
-    }
-    else if (MFX_ERR_MORE_DATA == sts) {
+    if (MFX_ERR_MORE_DATA == sts)
       ret = GST_MFX_DECODER_STATUS_ERROR_MORE_DATA;
-    } else if (sts < 0) {
-      GST_ERROR ("Decode header error %d\n", sts);
-      ret = GST_MFX_DECODER_STATUS_ERROR_BITSTREAM_PARSER;
-      goto done;
+  } else {
+    /* Headers are probed on data accumulated across calls, so input is
+     * only mapped and scanned once until they show up */
+    if (!probe_append_input (decoder))
+      return GST_MFX_DECODER_STATUS_ERROR_UNKNOWN;
+
+    if (probe_uses_start_codes (decoder)
+        && !probe_skip_to_parameter_set (decoder))
+      return GST_MFX_DECODER_STATUS_ERROR_MORE_DATA;
+
+    if (!decoder->probe.len)
+      return GST_MFX_DECODER_STATUS_ERROR_MORE_DATA;
+
+    decoder->bs.Data = bitstream_get_data (&decoder->probe);
+    decoder->bs.DataOffset = 0;
+    decoder->bs.DataLength = decoder->bs.MaxLength = decoder->probe.len;
+
+    sts = MFXVideoDECODE_DecodeHeader (decoder->session, &decoder->bs,
+        &decoder->params);
+    if (MFX_ERR_MORE_DATA == sts || sts > 0) {
+      /* Whatever the parser skipped will not be looked at again */
+      bitstream_flush (&decoder->probe, decoder->bs.DataOffset);
+      reset_bitstream (decoder);
+      return GST_MFX_DECODER_STATUS_ERROR_MORE_DATA;
     }
+  }
+
+  if (sts < 0 && MFX_ERR_MORE_DATA != sts) {
+    GST_ERROR ("Decode header error %d\n", sts);
+    reset_bitstream (decoder);
+    return GST_MFX_DECODER_STATUS_ERROR_BITSTREAM_PARSER;
+  }
 
-    if (cur_frame)
-      gst_buffer_unmap (cur_frame->input_buffer, &minfo);
-  } while (cur_frame);
+  probe_clear (decoder);
 
   gst_mfx_decoder_reconfigure_params (decoder);
 
@@ -575,8 +1063,7 @@ gst_mfx_decoder_prepare (GstMfxDecoder * decoder)
       &decoder->request);
   if (sts < 0) {
     GST_ERROR ("Unable to query decode allocation request %d", sts);
-    ret = GST_MFX_DECODER_STATUS_ERROR_INVALID_PARAMETER;
-    goto done;
+    return GST_MFX_DECODER_STATUS_ERROR_INVALID_PARAMETER;
   } else if (sts == MFX_WRN_PARTIAL_ACCELERATION) {
     decoder->params.IOPattern = MFX_IOPATTERN_OUT_SYSTEM_MEMORY;
   }
@@ -596,17 +1083,72 @@ gst_mfx_decoder_prepare (GstMfxDecoder * decoder)
   gst_mfx_task_set_video_params (decoder->decode, &decoder->params);
   decoder->configured = TRUE;
 
-  memset (&decoder->bs, 0, sizeof (mfxBitstream));
+  reset_bitstream (decoder);
   if (MFX_CODEC_VC1 == decoder->profile.codec
       && MFX_PROFILE_VC1_ADVANCED == decoder->profile.profile)
     decoder->bs.DataOffset = 1;
 
-done:
-  if (cur_frame)
-    gst_buffer_unmap (cur_frame->input_buffer, &minfo);
   return ret;
 }
 
+/* Parses stream headers out of codec_data before any frame arrives, so
+ * that header parsing and negotiation overlap with upstream prerolling.
+ * Returns GST_MFX_DECODER_STATUS_CONFIGURED on success, otherwise the
+ * headers are looked for in the first frames as usual */
+GstMfxDecoderStatus
+gst_mfx_decoder_prepare_from_codec_data (GstMfxDecoder * decoder)
+{
+  GstMfxDecoderStatus ret;
+
+  g_return_val_if_fail (decoder != NULL,
+      GST_MFX_DECODER_STATUS_ERROR_INVALID_PARAMETER);
+
+  if (decoder->configured || !decoder->codec_data
+      || decoder->probe.len || !g_queue_is_empty (&decoder->input_frames))
+    return GST_MFX_DECODER_STATUS_ERROR_MORE_DATA;
+
+  if (MFX_CODEC_VC1 == decoder->profile.codec
+      && MFX_PROFILE_VC1_ADVANCED == decoder->profile.profile)
+    return gst_mfx_decoder_prepare (decoder);
+
+  if (!probe_uses_start_codes (decoder))
+    return GST_MFX_DECODER_STATUS_ERROR_MORE_DATA;
+
+  /* Following input gets appended behind the parameter sets */
+  bitstream_append (&decoder->probe, decoder->codec_data->data,
+      decoder->codec_data->len);
+
+  ret = gst_mfx_decoder_prepare (decoder);
+  if (GST_MFX_DECODER_STATUS_CONFIGURED == ret) {
+    /* Input may only carry parameter sets out of band, so start decoding
+     * with the ones just parsed */
+    bitstream_append (&decoder->bitstream, decoder->codec_data->data,
+        decoder->codec_data->len);
+    decoder->bs.Data = bitstream_get_data (&decoder->bitstream);
+    decoder->bs.DataLength = decoder->codec_data->len;
+    decoder->bs.MaxLength = decoder->bs.DataLength;
+  }
+  return ret;
+}
+
+/* Initializes the MFX decoder and allocates its surfaces once configured,
+ * instead of waiting for the first frame */
+gboolean
+gst_mfx_decoder_start (GstMfxDecoder * decoder)
+{
+  g_return_val_if_fail (decoder != NULL, FALSE);
+
+  if (decoder->inited)
+    return TRUE;
+  if (!decoder->configured)
+    return FALSE;
+
+  if (GST_MFX_DECODER_STATUS_SUCCESS != start_decoder (decoder))
+    return FALSE;
+  decoder->inited = TRUE;
+  return TRUE;
+}
+
 gboolean
 gst_mfx_decoder_reinit (GstMfxDecoder * decoder)
 {
@@ -622,18 +1164,19 @@ gst_mfx_decoder_reset (GstMfxDecoder * decoder)
   g_queue_foreach (&decoder->input_frames,
       (GFunc) gst_video_codec_frame_unref, NULL);
   g_queue_clear (&decoder->input_frames);
+  probe_clear (decoder);
 
   /* Flush pending frames */
-  while (!g_queue_is_empty (&decoder->pending_frames))
-    g_queue_push_head (&decoder->discarded_frames,
-        g_queue_pop_head (&decoder->pending_frames));
+  discard_pending_frames (decoder);
 
   decoder->pts_offset = GST_CLOCK_TIME_NONE;
   decoder->current_pts = 0;
 
-  if (decoder->bitstream->len)
-    g_byte_array_remove_range (decoder->bitstream, 0, decoder->bitstream->len);
-  memset (&decoder->bs, 0, sizeof (mfxBitstream));
+  /* Surfaces still being decoded belong to the discarded frames */
+  wait_decoded_surfaces (decoder);
+
+  bitstream_clear (&decoder->bitstream);
+  reset_bitstream (decoder);
 
   decoder->was_reset = TRUE;
   decoder->has_ready_frames = FALSE;
@@ -666,7 +1209,7 @@ queue_output_frame (GstMfxDecoder * decoder, GstMfxSurface * surface)
   GstVideoCodecFrame *out_frame;
 
   if (!decoder->can_double_deinterlace)
-    out_frame = g_queue_pop_tail (&decoder->pending_frames);
+    out_frame = pending_frames_pop (decoder);
   else
     out_frame = new_frame (decoder);
 
@@ -683,13 +1226,46 @@ queue_output_frame (GstMfxDecoder * decoder, GstMfxSurface * surface)
       GST_MFX_SURFACE_FRAME_SURFACE (surface)->Data.FrameOrder);
 }
 
-static gint
-sort_pts (gconstpointer frame1, gconstpointer frame2, gpointer data)
+static GstMfxDecoderStatus
+output_surface (GstMfxDecoder * decoder, GstMfxSurface * surface)
+{
+  GstMfxFilterStatus filter_sts;
+  GstMfxSurface *filter_surface;
+
+  if (decoder->filter) {
+    do {
+      filter_sts = gst_mfx_filter_process (decoder->filter, surface,
+          &filter_surface);
+      queue_output_frame (decoder, filter_surface);
+    } while (GST_MFX_FILTER_STATUS_ERROR_MORE_SURFACE == filter_sts);
+
+    if (GST_MFX_FILTER_STATUS_SUCCESS != filter_sts) {
+      GST_ERROR ("MFX post-processing error while decoding.");
+      return GST_MFX_DECODER_STATUS_ERROR_UNKNOWN;
+    }
+  } else {
+    queue_output_frame (decoder, surface);
+  }
+  return GST_MFX_DECODER_STATUS_SUCCESS;
+}
+
+/* Outputs a decoded surface right away. The syncpoint travels along with
+ * the surface, so that downstream MFX components chain their work on it
+ * and only CPU users end up waiting */
+static GstMfxDecoderStatus
+output_decoded_surface (GstMfxDecoder * decoder, mfxSyncPoint syncp,
+    mfxFrameSurface1 * outsurf)
 {
-  GstClockTime pts1 = ((GstVideoCodecFrame *) (frame1))->pts;
-  GstClockTime pts2 = ((GstVideoCodecFrame *) (frame2))->pts;
+  GstMfxSurface *const surface =
+      gst_mfx_surface_pool_find_surface (decoder->pool, outsurf);
+
+  /* Shared decode / encode sessions leave synchronization to the encoder */
+  if (!gst_mfx_task_has_type (decoder->decode, GST_MFX_TASK_ENCODER)) {
+    gst_mfx_surface_set_sync_point (surface, decoder->session, syncp);
+    push_sync_surface (decoder, surface);
+  }
 
-  return (pts1 > pts2 ? -1 : pts1 == pts2 ? 0 : +1);
+  return output_surface (decoder, surface);
 }
 
 GstMfxDecoderStatus
@@ -698,8 +1274,7 @@ gst_mfx_decoder_decode (GstMfxDecoder * decoder, GstVideoCodecFrame * frame)
   GstMapInfo minfo = { 0 };
   GstVideoCodecFrame *input_frame = NULL;
   GstMfxDecoderStatus ret = GST_MFX_DECODER_STATUS_SUCCESS;
-  GstMfxFilterStatus filter_sts;
-  GstMfxSurface *surface, *filter_surface;
+  GstMfxSurface *surface;
   mfxFrameSurface1 *insurf = NULL, *outsurf = NULL;
   mfxSyncPoint syncp;
   mfxStatus sts = MFX_ERR_NONE;
@@ -711,7 +1286,7 @@ gst_mfx_decoder_decode (GstMfxDecoder * decoder, GstVideoCodecFrame * frame)
 
   if (!decoder->can_double_deinterlace) {
     /* Save frames for later synchronization with decoded MFX surfaces */
-    g_queue_insert_sorted (&decoder->pending_frames, frame, sort_pts, NULL);
+    pending_frames_push (decoder, frame);
   } else {
     g_queue_push_head (&decoder->discarded_frames, frame);
   }
@@ -723,7 +1298,7 @@ gst_mfx_decoder_decode (GstMfxDecoder * decoder, GstVideoCodecFrame * frame)
     if (!decoder->configured)
       ret = gst_mfx_decoder_prepare (decoder);
     else
-      ret = gst_mfx_decoder_start (decoder);
+      ret = start_decoder (decoder);
 
     if (GST_MFX_DECODER_STATUS_SUCCESS == ret)
       decoder->inited = TRUE;
@@ -747,21 +1322,28 @@ gst_mfx_decoder_decode (GstMfxDecoder * decoder, GstVideoCodecFrame * frame)
 
           sts = MFXVideoDECODE_DecodeHeader (decoder->session, &decoder->bs,
               &decoder->params);
-          memset (&decoder->bs, 0, sizeof (mfxBitstream));
+          reset_bitstream (decoder);
           if (MFX_ERR_MORE_DATA == sts) {
-            decoder->bitstream = g_byte_array_append (decoder->bitstream,
+            bitstream_append (&decoder->bitstream,
                 decoder->codec_data->data, decoder->codec_data->len);
             decoder->bs.DataLength = decoder->codec_data->len;
             decoder->bs.MaxLength = decoder->bs.DataLength;
-            decoder->bs.Data = decoder->bitstream->data;
+            decoder->bs.Data = bitstream_get_data (&decoder->bitstream);
           }
         } else if (MFX_CODEC_VC1 == decoder->profile.codec
             && MFX_PROFILE_VC1_ADVANCED == decoder->profile.profile) {
-          decoder->bitstream = g_byte_array_append (decoder->bitstream,
+          bitstream_append (&decoder->bitstream,
               decoder->codec_data->data, decoder->codec_data->len);
+          decoder->bs.Data = bitstream_get_data (&decoder->bitstream);
           decoder->bs.DataLength += decoder->codec_data->len;
           /* MSDK ignores the first byte indicating the VC1 profile */
           decoder->bs.DataOffset = 1;
+        } else if (decoder->nal_length_size) {
+          /* Packetized streams usually carry their parameter sets in
+           * codec_data only */
+          bitstream_append (&decoder->bitstream,
+              decoder->codec_data->data, decoder->codec_data->len);
+          decoder->bs.DataLength += decoder->codec_data->len;
         }
         decoder->was_reset = FALSE;
       } else {
@@ -771,11 +1353,22 @@ gst_mfx_decoder_decode (GstMfxDecoder * decoder, GstVideoCodecFrame * frame)
     }
 
     if (minfo.size) {
-      decoder->bitstream = g_byte_array_append (decoder->bitstream,
-          minfo.data, minfo.size);
-      decoder->bs.DataLength += minfo.size;
-      decoder->bs.MaxLength = decoder->bs.DataLength + decoder->bs.DataOffset;
-      decoder->bs.Data = decoder->bitstream->data;
+      if ((decoder->bs.DataFlag & MFX_BITSTREAM_COMPLETE_FRAME)
+          && !decoder->bitstream.len && !decoder->bs.DataOffset
+          && !decoder->nal_length_size) {
+        /* Nothing left over from previous frames, decode straight from
+         * the input buffer */
+        decoder->bs.Data = minfo.data;
+        decoder->bs.DataLength = decoder->bs.MaxLength = minfo.size;
+      } else {
+        guint len = decoder->bitstream.len;
+
+        append_input (decoder, &decoder->bitstream, minfo.data, minfo.size);
+        decoder->bs.DataLength += decoder->bitstream.len - len;
+        decoder->bs.MaxLength =
+            decoder->bs.DataLength + decoder->bs.DataOffset;
+        decoder->bs.Data = bitstream_get_data (&decoder->bitstream);
+      }
     }
 
     do {
@@ -789,8 +1382,10 @@ gst_mfx_decoder_decode (GstMfxDecoder * decoder, GstVideoCodecFrame * frame)
       GST_DEBUG ("MFXVideoDECODE_DecodeFrameAsync status: %d", sts);
 
       if (MFX_WRN_DEVICE_BUSY == sts)
-        g_usleep (100);
+        gst_mfx_task_aggregator_wait_device_busy (decoder->aggregator,
+            &decoder->busy, sync_oldest_surface, decoder);
     } while (sts > 0 || MFX_ERR_MORE_SURFACE == sts);
+    gst_mfx_device_busy_reset (&decoder->busy);
 
     if (MFX_ERR_MORE_DATA == sts) {
       if (decoder->has_ready_frames && !decoder->can_double_deinterlace) {
@@ -848,21 +1443,8 @@ update:
       }
 #endif
 
-      if (!decoder->can_double_deinterlace && decoder->num_partial_frames) {
-        GstVideoCodecFrame *cur_frame;
-        guint n = g_queue_get_length (&decoder->pending_frames) - 1;
-
-        /* Discard partial frames */
-        while (decoder->num_partial_frames
-            && (cur_frame = g_queue_peek_nth (&decoder->pending_frames, n))) {
-          if ((cur_frame->pts - decoder->pts_offset) % decoder->duration) {
-            g_queue_push_head (&decoder->discarded_frames,
-                g_queue_pop_nth (&decoder->pending_frames, n));
-            decoder->num_partial_frames--;
-          }
-          n--;
-        }
-      }
+      if (!decoder->can_double_deinterlace && decoder->num_partial_frames)
+        discard_partial_frames (decoder);
 
       if (decoder->skip_corrupted_frames
           && insurf->Data.Corrupted & MFX_CORRUPTION_MAJOR) {
@@ -871,49 +1453,26 @@ update:
         goto end;
       }
 
-      surface = gst_mfx_surface_pool_find_surface (decoder->pool, outsurf);
-
-      if (!gst_mfx_task_has_type (decoder->decode, GST_MFX_TASK_ENCODER)) {
-        do {
-          sts = MFXVideoCORE_SyncOperation (decoder->session, syncp, 1000);
-          if (MFX_ERR_NONE != sts && sts < 0) {
-            GST_ERROR ("MFXVideoCORE_SyncOperation() error status: %d", sts);
-            ret = GST_MFX_DECODER_STATUS_ERROR_UNKNOWN;
-            goto end;
-          }
-        } while (MFX_WRN_IN_EXECUTION == sts);
-      }
-
-      if (decoder->filter) {
-        do {
-          filter_sts = gst_mfx_filter_process (decoder->filter, surface,
-              &filter_surface);
-          queue_output_frame (decoder, filter_surface);
-        } while (GST_MFX_FILTER_STATUS_ERROR_MORE_SURFACE == filter_sts);
-
-        if (GST_MFX_FILTER_STATUS_SUCCESS != filter_sts) {
-          GST_ERROR ("MFX post-processing error while decoding.");
-          ret = GST_MFX_DECODER_STATUS_ERROR_UNKNOWN;
-          goto end;
-        }
-      } else {
-        queue_output_frame (decoder, surface);
-      }
+      ret = output_decoded_surface (decoder, syncp, outsurf);
+      if (GST_MFX_DECODER_STATUS_SUCCESS != ret)
+        goto end;
 
       decoder->has_ready_frames = TRUE;
-      decoder->bitstream = g_byte_array_remove_range (decoder->bitstream, 0,
-          decoder->bs.DataOffset);
-      decoder->bs.DataOffset = 0;
-
-      ret = GST_MFX_DECODER_STATUS_SUCCESS;
+      if (decoder->bs.Data != minfo.data) {
+        bitstream_flush (&decoder->bitstream, decoder->bs.DataOffset);
+        decoder->bs.Data = bitstream_get_data (&decoder->bitstream);
+        decoder->bs.DataOffset = 0;
+      }
     }
 
+    detach_input_memory (decoder, &minfo);
     gst_buffer_unmap (input_frame->input_buffer, &minfo);
     gst_video_codec_frame_unref (input_frame);
   }
 
 end:
   if (input_frame) {
+    detach_input_memory (decoder, &minfo);
     gst_buffer_unmap (input_frame->input_buffer, &minfo);
     gst_video_codec_frame_unref (input_frame);
   }
@@ -921,14 +1480,26 @@ end:
   return ret;
 }
 
+/* Reports how often and for how long decoding had to wait for a busy
+ * device, in microseconds */
+void
+gst_mfx_decoder_get_device_busy_stats (GstMfxDecoder * decoder,
+    guint64 * retries, guint64 * busy_time)
+{
+  g_return_if_fail (decoder != NULL);
+
+  if (retries)
+    *retries = decoder->busy.retries;
+  if (busy_time)
+    *busy_time = decoder->busy.busy_time_us;
+}
+
 GstMfxDecoderStatus
 gst_mfx_decoder_flush (GstMfxDecoder * decoder)
 {
-  GstMfxDecoderStatus ret;
-  GstMfxFilterStatus filter_sts;
-  GstMfxSurface *surface, *filter_surface;
+  GstMfxSurface *surface;
   mfxFrameSurface1 *insurf, *outsurf = NULL;
-  mfxSyncPoint syncp;
+  mfxSyncPoint syncp = NULL;
   mfxStatus sts;
 
   g_return_val_if_fail (decoder != NULL, GST_MFX_DECODER_STATUS_FLUSHED);
@@ -943,33 +1514,15 @@ gst_mfx_decoder_flush (GstMfxDecoder * decoder)
         insurf, &outsurf, &syncp);
     GST_DEBUG ("MFXVideoDECODE_DecodeFrameAsync() status: %d", sts);
     if (sts == MFX_WRN_DEVICE_BUSY)
-      g_usleep (100);
+      gst_mfx_task_aggregator_wait_device_busy (decoder->aggregator,
+          &decoder->busy, sync_oldest_surface, decoder);
   } while (MFX_WRN_DEVICE_BUSY == sts);
+  gst_mfx_device_busy_reset (&decoder->busy);
 
-  if (syncp) {
-    do {
-      sts = MFXVideoCORE_SyncOperation (decoder->session, syncp, 1000);
-      if (MFX_ERR_NONE != sts && sts < 0) {
-        GST_ERROR ("MFXVideoCORE_SyncOperation() error status: %d", sts);
-        return GST_MFX_DECODER_STATUS_ERROR_UNKNOWN;
-      }
-    } while (MFX_WRN_IN_EXECUTION == sts);
-
-    surface = gst_mfx_surface_pool_find_surface (decoder->pool, outsurf);
+  if (syncp)
+    return output_decoded_surface (decoder, syncp, outsurf);
+  if (MFX_ERR_MORE_SURFACE == sts)
+    return GST_MFX_DECODER_STATUS_SUCCESS;
 
-    if (decoder->filter) {
-      do {
-        filter_sts = gst_mfx_filter_process (decoder->filter, surface,
-            &filter_surface);
-        queue_output_frame (decoder, filter_surface);
-      } while (GST_MFX_FILTER_STATUS_ERROR_MORE_SURFACE == filter_sts);
-    } else {
-      queue_output_frame (decoder, surface);
-    }
-
-    ret = GST_MFX_DECODER_STATUS_SUCCESS;
-  } else {
-    ret = GST_MFX_DECODER_STATUS_FLUSHED;
-  }
-  return ret;
+  return GST_MFX_DECODER_STATUS_FLUSHED;
 }
@@ -79,10 +79,20 @@ gst_mfx_decoder_update_video_info (GstMfxDecoder * decoder,
 void
 gst_mfx_decoder_skip_corrupted_frames (GstMfxDecoder * decoder);
 
+gboolean
+gst_mfx_decoder_set_packetized (GstMfxDecoder * decoder,
+    gboolean headers_in_band);
+
 void
 gst_mfx_decoder_set_output_memtype (GstMfxDecoder * decoder,
     gboolean memtype_is_system);
 
+GstMfxDecoderStatus
+gst_mfx_decoder_prepare_from_codec_data (GstMfxDecoder * decoder);
+
+gboolean
+gst_mfx_decoder_start (GstMfxDecoder * decoder);
+
 gboolean
 gst_mfx_decoder_reinit (GstMfxDecoder * decoder);
 
@@ -95,5 +105,9 @@ gst_mfx_decoder_decode (GstMfxDecoder * decoder, GstVideoCodecFrame * frame);
 GstMfxDecoderStatus
 gst_mfx_decoder_flush (GstMfxDecoder * decoder);
 
+void
+gst_mfx_decoder_get_device_busy_stats (GstMfxDecoder * decoder,
+    guint64 * retries, guint64 * busy_time);
+
 G_END_DECLS
 #endif /* GST_MFX_DECODER_H */
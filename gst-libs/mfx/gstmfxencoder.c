@@ -33,9 +33,120 @@
 #define DEFAULT_QUANTIZER           21
 #define DEFAULT_ASYNC_DEPTH         4
 
+/* Bytes left free in front of the encoded data, so that conversions to
+ * length prefixed NALs can grow the output in place */
+#define BITSTREAM_HEADROOM          64
+
+/* Output buffers kept around beyond the encode operations in flight, for
+ * the ones downstream still holds */
+#define BITSTREAM_POOL_MARGIN       2
+
 G_DEFINE_TYPE_WITH_CODE (GstMfxEncoder, gst_mfx_encoder, GST_TYPE_OBJECT,
     G_ADD_PRIVATE (GstMfxEncoder));
 
+/* Output bitstream of a single encode operation */
+typedef struct _GstMfxEncoderBitstream GstMfxEncoderBitstream;
+struct _GstMfxEncoderBitstream
+{
+  GstBuffer *buffer;
+  GstMapInfo minfo;
+  mfxBitstream bs;
+  mfxSyncPoint syncp;
+  GstVideoCodecFrame *frame;
+
+  /* Set by the aggregator completion thread */
+  GstMfxEncoderPrivate *priv;
+  gboolean completed;
+  mfxStatus sync_status;
+};
+
+/* Maps @buffer as the output memory of @bitstream, taking ownership */
+static gboolean
+bitstream_attach_buffer (GstMfxEncoderBitstream * bitstream,
+    GstBuffer * buffer)
+{
+  if (!buffer)
+    return FALSE;
+
+  if (!gst_buffer_map (buffer, &bitstream->minfo, GST_MAP_WRITE)) {
+    GST_ERROR ("Failed to map bitstream buffer");
+    gst_buffer_unref (buffer);
+    return FALSE;
+  }
+
+  bitstream->buffer = buffer;
+  bitstream->bs.Data = bitstream->minfo.data;
+  bitstream->bs.MaxLength = bitstream->minfo.size;
+  bitstream->bs.DataOffset = MIN (BITSTREAM_HEADROOM, bitstream->minfo.size);
+  bitstream->bs.DataLength = 0;
+  return TRUE;
+}
+
+static GstBuffer *
+bitstream_detach_buffer (GstMfxEncoderBitstream * bitstream)
+{
+  GstBuffer *buffer = bitstream->buffer;
+
+  if (!buffer)
+    return NULL;
+
+  gst_buffer_unmap (buffer, &bitstream->minfo);
+  bitstream->buffer = NULL;
+  bitstream->bs.Data = NULL;
+  bitstream->bs.MaxLength = 0;
+  return buffer;
+}
+
+static void
+bitstream_free (GstMfxEncoderBitstream * bitstream)
+{
+  GstBuffer *buffer = bitstream_detach_buffer (bitstream);
+
+  if (buffer)
+    gst_buffer_unref (buffer);
+  if (bitstream->frame)
+    gst_video_codec_frame_unref (bitstream->frame);
+  g_slice_free (GstMfxEncoderBitstream, bitstream);
+}
+
+static void
+bitstream_completed (mfxStatus status, gpointer user_data)
+{
+  GstMfxEncoderBitstream *const bitstream = user_data;
+  GstMfxEncoderPrivate *const priv = bitstream->priv;
+
+  g_mutex_lock (&priv->completion_lock);
+  bitstream->sync_status = status;
+  bitstream->completed = TRUE;
+  g_cond_broadcast (&priv->completion_cond);
+  g_mutex_unlock (&priv->completion_lock);
+}
+
+static void
+bitstream_wait (GstMfxEncoderPrivate * priv,
+    GstMfxEncoderBitstream * bitstream)
+{
+  g_mutex_lock (&priv->completion_lock);
+  while (!bitstream->completed)
+    g_cond_wait (&priv->completion_cond, &priv->completion_lock);
+  g_mutex_unlock (&priv->completion_lock);
+}
+
+/* Waits on the oldest in-flight encode operation while the device is busy */
+static gboolean
+sync_oldest_bitstream (gpointer data)
+{
+  GstMfxEncoderPrivate *const priv = data;
+  GstMfxEncoderBitstream *bitstream =
+      g_queue_peek_head (&priv->pending_bitstreams);
+
+  if (!bitstream)
+    return FALSE;
+
+  bitstream_wait (priv, bitstream);
+  return TRUE;
+}
+
 /* Helper function to create a new encoder property object */
 static GstMfxEncoderPropData *
 prop_new (gint id, GParamSpec * pspec)
@@ -144,7 +255,8 @@ gst_mfx_encoder_properties_get_default (const GstMfxEncoderClass * klass)
       g_param_spec_uint ("bitrate",
           "Bitrate (kbps)",
           "The desired bitrate expressed in kbps (0: auto-calculate)",
-          0, G_MAXUINT16, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+          0, G_MAXUINT16, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
 
  /**
   * GstMfxEncoder:brc-multiplier
@@ -180,7 +292,8 @@ gst_mfx_encoder_properties_get_default (const GstMfxEncoderClass * klass)
       g_param_spec_uint ("max-bitrate",
           "Video Buffering Verifier (VBV) maximum bit rate (Kbps)",
           "Maximum bit rate at which encoded data enters the VBV",
-          0, G_MAXUINT16, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+          0, G_MAXUINT16, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
 
  /**
   * GstMfxEncoder:idr-interval
@@ -204,7 +317,8 @@ gst_mfx_encoder_properties_get_default (const GstMfxEncoderClass * klass)
       g_param_spec_uint ("gop-size",
           "GOP size",
           "Number of pictures within the current GOP",
-          0, G_MAXUINT16, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+          0, G_MAXUINT16, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
 
  /**
   * GstMfxEncoder:gop-distance
@@ -252,7 +366,8 @@ gst_mfx_encoder_properties_get_default (const GstMfxEncoderClass * klass)
       g_param_spec_uint ("quantizer",
           "Constant quantizer",
           "Constant quantizer or quality to apply", 0, 51,
-          DEFAULT_QUANTIZER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+          DEFAULT_QUANTIZER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
 
  /**
   * GstMfxEncoder:qpi-offset
@@ -586,11 +701,7 @@ gst_mfx_encoder_init_properties (GstMfxEncoder * encoder,
   GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
 
   priv->aggregator = gst_mfx_task_aggregator_ref (aggregator);
-  priv->bs.MaxLength = info->width * info->height * 4;
-  priv->bitstream = g_byte_array_sized_new (priv->bs.MaxLength);
-  if (!priv->bitstream)
-    return FALSE;
-  priv->bs.Data = priv->bitstream->data;
+  priv->bitstream_size = info->width * info->height * 4;
   priv->async_depth = DEFAULT_ASYNC_DEPTH;
   priv->input_memtype_is_system = memtype_is_system;
   /* Assume encoder memtype is in video memory first */
@@ -643,8 +754,23 @@ gst_mfx_encoder_finalize (GObject * object)
 {
   GstMfxEncoder *encoder = GST_MFX_ENCODER (object);
   GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
-
-  g_byte_array_unref (priv->bitstream);
+  GList *l;
+
+  /* The completion thread may still reference in-flight bitstreams */
+  for (l = priv->pending_bitstreams.head; l; l = l->next)
+    bitstream_wait (priv, l->data);
+
+  g_queue_foreach (&priv->free_bitstreams, (GFunc) bitstream_free, NULL);
+  g_queue_foreach (&priv->pending_bitstreams, (GFunc) bitstream_free, NULL);
+  g_queue_foreach (&priv->encoded_frames,
+      (GFunc) gst_video_codec_frame_unref, NULL);
+  g_queue_clear (&priv->free_bitstreams);
+  g_queue_clear (&priv->pending_bitstreams);
+  g_queue_clear (&priv->encoded_frames);
+  if (priv->bitstream_pool) {
+    gst_buffer_pool_set_active (priv->bitstream_pool, FALSE);
+    gst_object_unref (priv->bitstream_pool);
+  }
 
   if (priv->properties) {
     g_ptr_array_unref (priv->properties);
@@ -660,6 +786,8 @@ gst_mfx_encoder_finalize (GObject * object)
   gst_mfx_filter_replace (&priv->filter, NULL);
   gst_mfx_task_unref (priv->encode);
   gst_mfx_task_aggregator_unref (priv->aggregator);
+  g_mutex_clear (&priv->completion_lock);
+  g_cond_clear (&priv->completion_cond);
 
   G_OBJECT_CLASS (gst_mfx_encoder_parent_class)->finalize (object);
 }
@@ -667,6 +795,13 @@ gst_mfx_encoder_finalize (GObject * object)
 static void
 gst_mfx_encoder_init (GstMfxEncoder * encoder)
 {
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+
+  g_queue_init (&priv->free_bitstreams);
+  g_queue_init (&priv->pending_bitstreams);
+  g_queue_init (&priv->encoded_frames);
+  g_mutex_init (&priv->completion_lock);
+  g_cond_init (&priv->completion_cond);
 }
 
 static void
@@ -1247,11 +1382,60 @@ gst_mfx_encoder_prepare (GstMfxEncoder * encoder)
   return GST_MFX_ENCODER_STATUS_SUCCESS;
 }
 
+/* Output buffers are sized from the buffer size reported by the encoder,
+ * which MSDK requires of every output bitstream, and are recycled once
+ * downstream releases them. The pool is bounded so that worst-case sized
+ * buffers do not pile up when downstream queues many frames, buffers past
+ * that bound are allocated on their own and freed once released */
+static gboolean
+ensure_bitstream_pool (GstMfxEncoder * encoder)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+  mfxInfoMFX *const mfx = &priv->params.mfx;
+  GstStructure *config;
+  GstBufferPool *pool;
+
+  if (priv->bitstream_pool)
+    return TRUE;
+
+  if (MFX_CODEC_JPEG != mfx->CodecId && mfx->BufferSizeInKB)
+    priv->bitstream_size =
+        mfx->BufferSizeInKB * MAX (mfx->BRCParamMultiplier, 1) * 1000;
+
+  pool = gst_buffer_pool_new ();
+  if (!pool)
+    return FALSE;
+
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_set_params (config, NULL, priv->bitstream_size,
+      MAX (priv->params.AsyncDepth, 1),
+      MAX (priv->params.AsyncDepth, 1) + BITSTREAM_POOL_MARGIN);
+  if (!gst_buffer_pool_set_config (pool, config))
+    goto error_pool_config;
+  if (!gst_buffer_pool_set_active (pool, TRUE))
+    goto error_pool_config;
+
+  GST_DEBUG ("Allocating encoded output buffers of %u bytes",
+      priv->bitstream_size);
+
+  priv->bitstream_pool = pool;
+  return TRUE;
+
+  /* ERRORS */
+error_pool_config:
+  {
+    GST_ERROR ("failed to configure bitstream buffer pool");
+    gst_object_unref (pool);
+    return FALSE;
+  }
+}
+
 static GstMfxEncoderStatus
 gst_mfx_encoder_start (GstMfxEncoder * encoder)
 {
   GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
   mfxStatus sts = MFX_ERR_NONE;
+  guint i;
 
   /* Make sure frame allocator points to the right task
    * to allocate any internal surfaces */
@@ -1263,20 +1447,412 @@ gst_mfx_encoder_start (GstMfxEncoder * encoder)
     return GST_MFX_ENCODER_STATUS_ERROR_OPERATION_FAILED;
   }
 
+  /* Kept for later resets, GetVideoParam () does not report them */
+  priv->num_extparam = priv->params.NumExtParam;
+
   memset (&priv->params, 0, sizeof (mfxVideoParam));
   MFXVideoENCODE_GetVideoParam (priv->session, &priv->params);
 
+  if (!ensure_bitstream_pool (encoder))
+    return GST_MFX_ENCODER_STATUS_ERROR_ALLOCATION_FAILED;
+
+  /* Allow up to AsyncDepth encode operations in flight */
+  for (i = 0; i < MAX (priv->params.AsyncDepth, 1); i++) {
+    GstMfxEncoderBitstream *bitstream = g_slice_new0 (GstMfxEncoderBitstream);
+
+    bitstream->priv = priv;
+    g_queue_push_tail (&priv->free_bitstreams, bitstream);
+  }
+
   return GST_MFX_ENCODER_STATUS_SUCCESS;
 }
 
 static void
-calculate_new_pts_and_dts (GstMfxEncoder * encoder, GstVideoCodecFrame * frame)
+calculate_new_pts_and_dts (GstMfxEncoder * encoder, GstVideoCodecFrame * frame,
+    mfxBitstream * bs)
 {
   GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
 
   frame->duration = priv->duration;
-  frame->pts = (priv->bs.TimeStamp / (gdouble) 90000) * 1000000000;
-  frame->dts = (priv->bs.DecodeTimeStamp / (gdouble) 90000) * 1000000000;
+  frame->pts = (bs->TimeStamp / (gdouble) 90000) * 1000000000;
+  frame->dts = (bs->DecodeTimeStamp / (gdouble) 90000) * 1000000000;
+}
+
+static GstVideoCodecFrame *
+new_frame (void)
+{
+  GstVideoCodecFrame *frame = g_slice_new0 (GstVideoCodecFrame);
+  if (!frame)
+    return NULL;
+  frame->ref_count = 1;
+  return frame;
+}
+
+/* Waits for the oldest in-flight encode operation and queues its output */
+static GstMfxEncoderStatus
+output_oldest_bitstream (GstMfxEncoder * encoder)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+  GstMfxEncoderBitstream *bitstream;
+  GstVideoCodecFrame *frame;
+
+  bitstream = g_queue_pop_head (&priv->pending_bitstreams);
+  if (!bitstream)
+    return GST_MFX_ENCODER_STATUS_MORE_DATA;
+
+  bitstream_wait (priv, bitstream);
+  if (MFX_ERR_NONE != bitstream->sync_status && bitstream->sync_status < 0) {
+    gst_video_codec_frame_unref (bitstream->frame);
+    bitstream->frame = NULL;
+    g_queue_push_tail (&priv->free_bitstreams, bitstream);
+    return GST_MFX_ENCODER_STATUS_ERROR_OPERATION_FAILED;
+  }
+
+  frame = bitstream->frame;
+  bitstream->frame = NULL;
+
+  calculate_new_pts_and_dts (encoder, frame, &bitstream->bs);
+
+  if (bitstream->bs.FrameType & MFX_FRAMETYPE_IDR
+      || bitstream->bs.FrameType & MFX_FRAMETYPE_xIDR)
+    GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
+  else
+    GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
+
+  /* Hand the buffer over to the frame, it goes back to the pool once
+   * downstream is done with it */
+  frame->output_buffer = bitstream_detach_buffer (bitstream);
+  gst_buffer_resize (frame->output_buffer, bitstream->bs.DataOffset,
+      bitstream->bs.DataLength);
+
+  bitstream->bs.DataOffset = 0;
+  bitstream->bs.DataLength = 0;
+  g_queue_push_tail (&priv->free_bitstreams, bitstream);
+  g_queue_push_tail (&priv->encoded_frames, frame);
+
+  return GST_MFX_ENCODER_STATUS_SUCCESS;
+}
+
+/* Submits @insurf for encoding into the next free output bitstream.
+ * A NULL @insurf drains frames buffered inside the encoder. */
+static GstMfxEncoderStatus
+encode_frame_async (GstMfxEncoder * encoder, mfxFrameSurface1 * insurf,
+    GstVideoCodecFrame * frame)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+  GstMfxEncoderBitstream *bitstream;
+  GstMfxEncoderStatus ret;
+  GstBuffer *buffer = NULL;
+  mfxStatus sts = MFX_ERR_NONE;
+
+  /* All output bitstreams are in flight, wait for the oldest one */
+  if (g_queue_is_empty (&priv->free_bitstreams)) {
+    ret = output_oldest_bitstream (encoder);
+    if (GST_MFX_ENCODER_STATUS_SUCCESS != ret)
+      return ret;
+  }
+  bitstream = g_queue_peek_head (&priv->free_bitstreams);
+
+  if (!bitstream->buffer) {
+    GstBufferPoolAcquireParams params = { 0, };
+    GstFlowReturn flow;
+
+    /* Downstream holds on to all pooled buffers, allocate one outside of
+     * the pool rather than block until it lets go */
+    params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+    flow = gst_buffer_pool_acquire_buffer (priv->bitstream_pool, &buffer,
+        &params);
+    if (GST_FLOW_EOS == flow)
+      buffer = gst_buffer_new_allocate (NULL, priv->bitstream_size, NULL);
+    else if (GST_FLOW_OK != flow)
+      buffer = NULL;
+    if (!bitstream_attach_buffer (bitstream, buffer))
+      return GST_MFX_ENCODER_STATUS_ERROR_ALLOCATION_FAILED;
+  }
+
+  do {
+    sts = MFXVideoENCODE_EncodeFrameAsync (priv->session,
+        NULL, insurf, &bitstream->bs, &bitstream->syncp);
+
+    if (MFX_WRN_DEVICE_BUSY == sts)
+      gst_mfx_task_aggregator_wait_device_busy (priv->aggregator,
+          &priv->busy, sync_oldest_bitstream, priv);
+    else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts) {
+      gsize size = 2 * bitstream->bs.MaxLength;
+
+      /* Only expected if the reported buffer size was underestimated */
+      GST_WARNING ("Encoded frame exceeds %u bytes", bitstream->bs.MaxLength);
+      gst_buffer_unref (bitstream_detach_buffer (bitstream));
+      if (!bitstream_attach_buffer (bitstream,
+              gst_buffer_new_allocate (NULL, size, NULL)))
+        return GST_MFX_ENCODER_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+  } while (MFX_WRN_DEVICE_BUSY == sts || MFX_ERR_NOT_ENOUGH_BUFFER == sts);
+  gst_mfx_device_busy_reset (&priv->busy);
+
+  if (MFX_ERR_MORE_BITSTREAM == sts)
+    return GST_MFX_ENCODER_STATUS_NO_BUFFER;
+  else if (MFX_ERR_MORE_DATA == sts)
+    return GST_MFX_ENCODER_STATUS_MORE_DATA;
+
+  if (MFX_ERR_NONE != sts) {
+    GST_ERROR ("Status %d : Error during MFX encoding", sts);
+    return GST_MFX_ENCODER_STATUS_ERROR_UNKNOWN;
+  }
+
+  if (!bitstream->syncp)
+    return GST_MFX_ENCODER_STATUS_MORE_DATA;
+
+  bitstream->frame = frame ? gst_video_codec_frame_ref (frame) : new_frame ();
+  bitstream->completed = FALSE;
+  g_queue_push_tail (&priv->pending_bitstreams,
+      g_queue_pop_head (&priv->free_bitstreams));
+
+  /* Completion is signalled from the aggregator thread, so the encode
+   * path never polls the device itself */
+  gst_mfx_task_aggregator_submit (priv->aggregator, priv->session,
+      bitstream->syncp, bitstream_completed, bitstream);
+
+  return GST_MFX_ENCODER_STATUS_SUCCESS;
+}
+
+/* Reports how often and for how long encoding had to wait for a busy
+ * device, in microseconds */
+void
+gst_mfx_encoder_get_device_busy_stats (GstMfxEncoder * encoder,
+    guint64 * retries, guint64 * busy_time)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+
+  if (retries)
+    *retries = priv->busy.retries;
+  if (busy_time)
+    *busy_time = priv->busy.busy_time_us;
+}
+
+/* Updates the rate control and GOP fields of @mfx from the current
+ * property values. Kbps values reported by the encoder are in units of
+ * its BRCParamMultiplier, which may differ from the requested one */
+static void
+update_rate_control_params (GstMfxEncoder * encoder, mfxInfoMFX * mfx)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+  guint multiplier = MAX (mfx->BRCParamMultiplier, 1);
+  guint target_kbps, old_target_kbps = mfx->TargetKbps;
+
+  switch (priv->rc_method) {
+    case GST_MFX_RATECONTROL_CQP:
+      mfx->QPI = CLAMP (priv->global_quality + priv->qpi_offset, 0, 51);
+      mfx->QPP = CLAMP (priv->global_quality + priv->qpp_offset, 0, 51);
+      mfx->QPB = CLAMP (priv->global_quality + priv->qpb_offset, 0, 51);
+      break;
+    case GST_MFX_RATECONTROL_ICQ:
+    case GST_MFX_RATECONTROL_LA_ICQ:
+      mfx->ICQQuality = CLAMP (priv->global_quality, 1, 51);
+      break;
+    default:
+      if (!priv->bitrate)
+        break;
+
+      target_kbps = priv->bitrate * MAX (priv->brc_multiplier, 1);
+      mfx->TargetKbps = MIN (target_kbps / multiplier, G_MAXUINT16);
+      if (priv->vbv_max_bitrate > priv->bitrate)
+        mfx->MaxKbps = MIN (priv->vbv_max_bitrate *
+            MAX (priv->brc_multiplier, 1) / multiplier, G_MAXUINT16);
+      else if (old_target_kbps)
+        mfx->MaxKbps = MIN ((guint64) mfx->MaxKbps * mfx->TargetKbps /
+            old_target_kbps, G_MAXUINT16);
+
+      /* Scale an encoder chosen HRD buffer along with the bitrate */
+      if (!priv->max_buffer_size && old_target_kbps) {
+        mfx->BufferSizeInKB = MIN ((guint64) mfx->BufferSizeInKB *
+            mfx->TargetKbps / old_target_kbps, G_MAXUINT16);
+        mfx->InitialDelayInKB = MIN ((guint64) mfx->InitialDelayInKB *
+            mfx->TargetKbps / old_target_kbps, G_MAXUINT16);
+      }
+      if (mfx->MaxKbps && mfx->MaxKbps < mfx->TargetKbps)
+        mfx->MaxKbps = mfx->TargetKbps;
+      break;
+  }
+
+  if (priv->gop_size)
+    mfx->GopPicSize = priv->gop_size;
+}
+
+/* Grows the output buffers if the new settings raised the buffer size
+ * reported by the encoder */
+static gboolean
+refresh_bitstream_pool (GstMfxEncoder * encoder)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+  mfxInfoMFX *const mfx = &priv->params.mfx;
+  GstBuffer *buffer;
+  GList *l;
+
+  if (!mfx->BufferSizeInKB || mfx->BufferSizeInKB *
+      MAX (mfx->BRCParamMultiplier, 1) * 1000 <= priv->bitstream_size)
+    return TRUE;
+
+  for (l = priv->free_bitstreams.head; l; l = l->next) {
+    buffer = bitstream_detach_buffer (l->data);
+    if (buffer)
+      gst_buffer_unref (buffer);
+  }
+  gst_buffer_pool_set_active (priv->bitstream_pool, FALSE);
+  gst_object_unref (priv->bitstream_pool);
+  priv->bitstream_pool = NULL;
+
+  return ensure_bitstream_pool (encoder);
+}
+
+/**
+ * gst_mfx_encoder_reconfigure_rate_control:
+ * @encoder: a #GstMfxEncoder
+ *
+ * Applies the current bitrate, max-bitrate, GOP size and quantizer
+ * values to a running encoder. Frames still inside the encoder must
+ * have been drained with gst_mfx_encoder_flush () beforehand.
+ *
+ * The encoder is reset in place, starting a new sequence only if the
+ * change requires it, and closed and initialized again if the driver
+ * rejects the reset.
+ *
+ * Return value: a #GstMfxEncoderStatus
+ */
+GstMfxEncoderStatus
+gst_mfx_encoder_reconfigure_rate_control (GstMfxEncoder * encoder)
+{
+  GstMfxEncoderPrivate *priv;
+  mfxExtEncoderResetOption reset_option = { 0 };
+  mfxExtBuffer *ext_params[G_N_ELEMENTS (priv->extparam_internal) + 1];
+  mfxVideoParam params;
+  mfxStatus sts;
+  const gchar *method;
+  gint64 start_time;
+  guint64 elapsed;
+  guint i;
+
+  g_return_val_if_fail (encoder != NULL,
+      GST_MFX_ENCODER_STATUS_ERROR_INVALID_PARAMETER);
+
+  priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+  if (MFX_CODEC_JPEG == priv->profile.codec)
+    return GST_MFX_ENCODER_STATUS_SUCCESS;
+
+  /* Not started yet, the new values simply go to Init () */
+  if (!priv->inited) {
+    update_rate_control_params (encoder, &priv->params.mfx);
+    return GST_MFX_ENCODER_STATUS_SUCCESS;
+  }
+
+  if (!g_queue_is_empty (&priv->pending_bitstreams))
+    goto error_not_drained;
+
+  start_time = g_get_monotonic_time ();
+
+  params = priv->params;
+  update_rate_control_params (encoder, &params.mfx);
+
+  for (i = 0; i < priv->num_extparam; i++)
+    ext_params[i] = priv->extparam_internal[i];
+  reset_option.Header.BufferId = MFX_EXTBUFF_ENCODER_RESET_OPTION;
+  reset_option.Header.BufferSz = sizeof (reset_option);
+  ext_params[i] = (mfxExtBuffer *) & reset_option;
+  params.ExtParam = ext_params;
+  params.NumExtParam = priv->num_extparam + 1;
+
+  /* Rate control changes can take effect on the next frame, while a new
+   * GOP structure needs a new sequence. Drivers that cannot apply a rate
+   * change mid-sequence (e.g. with HRD conformance) get a second try
+   * with a new sequence as well */
+  reset_option.StartNewSequence =
+      params.mfx.GopPicSize != priv->params.mfx.GopPicSize ?
+      MFX_CODINGOPTION_ON : MFX_CODINGOPTION_OFF;
+  method = "reset";
+  sts = MFXVideoENCODE_Reset (priv->session, &params);
+  if (sts < 0 && MFX_CODINGOPTION_OFF == reset_option.StartNewSequence) {
+    GST_DEBUG ("Reset within the sequence rejected %d", sts);
+    reset_option.StartNewSequence = MFX_CODINGOPTION_ON;
+    sts = MFXVideoENCODE_Reset (priv->session, &params);
+  }
+  if (MFX_CODINGOPTION_ON == reset_option.StartNewSequence)
+    method = "reset with new sequence";
+
+  if (sts < 0) {
+    GST_WARNING ("Encoder reset rejected %d, reinitializing", sts);
+
+    params.NumExtParam = priv->num_extparam;
+    params.ExtParam = priv->num_extparam ? priv->extparam_internal : NULL;
+
+    gst_mfx_task_aggregator_set_current_task (priv->aggregator, priv->encode);
+    MFXVideoENCODE_Close (priv->session);
+    sts = MFXVideoENCODE_Init (priv->session, &params);
+    if (sts < 0)
+      goto error_reinit;
+    method = "reinit";
+    priv->reconfig_reinits++;
+  }
+
+  memset (&priv->params, 0, sizeof (mfxVideoParam));
+  MFXVideoENCODE_GetVideoParam (priv->session, &priv->params);
+
+  if (!refresh_bitstream_pool (encoder))
+    return GST_MFX_ENCODER_STATUS_ERROR_ALLOCATION_FAILED;
+
+  elapsed = g_get_monotonic_time () - start_time;
+  priv->reconfigs++;
+  priv->reconfig_last_us = elapsed;
+  priv->reconfig_max_us = MAX (priv->reconfig_max_us, elapsed);
+
+  GST_INFO ("Reconfigured to %u kbps, GOP %u by %s in %" G_GUINT64_FORMAT
+      " us", priv->params.mfx.TargetKbps *
+      MAX (priv->params.mfx.BRCParamMultiplier, 1),
+      priv->params.mfx.GopPicSize, method, elapsed);
+  return GST_MFX_ENCODER_STATUS_SUCCESS;
+
+  /* ERRORS */
+error_not_drained:
+  {
+    GST_ERROR ("encoder must be drained before reconfiguration");
+    return GST_MFX_ENCODER_STATUS_ERROR_OPERATION_FAILED;
+  }
+error_reinit:
+  {
+    GST_ERROR ("Error reinitializing the MFX video encoder %d", sts);
+    return GST_MFX_ENCODER_STATUS_ERROR_OPERATION_FAILED;
+  }
+}
+
+/* Reports how many runtime reconfigurations were applied, how many of
+ * them needed a full reinitialization, and the last and worst time they
+ * took, in microseconds */
+void
+gst_mfx_encoder_get_reconfigure_stats (GstMfxEncoder * encoder,
+    guint64 * count, guint64 * reinits, guint64 * last_latency,
+    guint64 * max_latency)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+
+  if (count)
+    *count = priv->reconfigs;
+  if (reinits)
+    *reinits = priv->reconfig_reinits;
+  if (last_latency)
+    *last_latency = priv->reconfig_last_us;
+  if (max_latency)
+    *max_latency = priv->reconfig_max_us;
+}
+
+gboolean
+gst_mfx_encoder_get_frame (GstMfxEncoder * encoder,
+    GstVideoCodecFrame ** out_frame)
+{
+  GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
+
+  g_return_val_if_fail (out_frame != NULL, FALSE);
+
+  *out_frame = g_queue_pop_head (&priv->encoded_frames);
+  return *out_frame != NULL;
 }
 
 GstMfxEncoderStatus
@@ -1286,8 +1862,6 @@ gst_mfx_encoder_encode (GstMfxEncoder * encoder, GstVideoCodecFrame * frame)
   GstMfxSurface *surface, *filter_surface;
   GstMfxFilterStatus filter_sts;
   mfxFrameSurface1 *insurf = NULL;
-  mfxSyncPoint syncp;
-  mfxStatus sts = MFX_ERR_NONE;
 
   surface = gst_video_codec_frame_get_user_data (frame);
 
@@ -1325,108 +1899,28 @@ gst_mfx_encoder_encode (GstMfxEncoder * encoder, GstVideoCodecFrame * frame)
       gst_util_uint64_scale (priv->current_pts, 90000, GST_SECOND);
   priv->current_pts += priv->duration;
 
-  do {
-    sts = MFXVideoENCODE_EncodeFrameAsync (priv->session,
-        NULL, insurf, &priv->bs, &syncp);
-
-    if (MFX_WRN_DEVICE_BUSY == sts)
-      g_usleep (500);
-    else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts) {
-      priv->bs.MaxLength += 1024 * 16;
-      priv->bitstream = g_byte_array_set_size (priv->bitstream,
-          priv->bs.MaxLength);
-      priv->bs.Data = priv->bitstream->data;
-    }
-  } while (MFX_WRN_DEVICE_BUSY == sts || MFX_ERR_NOT_ENOUGH_BUFFER == sts);
-
-  if (MFX_ERR_MORE_BITSTREAM == sts)
-    return GST_MFX_ENCODER_STATUS_NO_BUFFER;
-  else if (MFX_ERR_MORE_DATA == sts)
-    return GST_MFX_ENCODER_STATUS_MORE_DATA;
-
-  if (MFX_ERR_NONE != sts) {
-    GST_ERROR ("Status %d : Error during MFX encoding", sts);
-    return GST_MFX_ENCODER_STATUS_ERROR_UNKNOWN;
-  }
-
-  if (syncp) {
-    do {
-      sts = MFXVideoCORE_SyncOperation (priv->session, syncp, 1000);
-      if (MFX_ERR_NONE != sts && sts < 0) {
-        GST_ERROR ("MFXVideoCORE_SyncOperation() error status: %d", sts);
-        return GST_MFX_ENCODER_STATUS_ERROR_OPERATION_FAILED;
-      }
-    } while (MFX_WRN_IN_EXECUTION == sts);
-
-    frame->output_buffer =
-        gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
-        priv->bs.Data, priv->bs.MaxLength,
-        priv->bs.DataOffset, priv->bs.DataLength, NULL, NULL);
-
-    calculate_new_pts_and_dts (encoder, frame);
-
-    priv->bs.DataLength = 0;
-  }
-
-  if (priv->bs.FrameType & MFX_FRAMETYPE_IDR
-      || priv->bs.FrameType & MFX_FRAMETYPE_xIDR)
-    GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
-  else
-    GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
-
-  return GST_MFX_ENCODER_STATUS_SUCCESS;
+  return encode_frame_async (encoder, insurf, frame);
 }
 
 GstMfxEncoderStatus
 gst_mfx_encoder_flush (GstMfxEncoder * encoder, GstVideoCodecFrame ** frame)
 {
   GstMfxEncoderPrivate *const priv = GST_MFX_ENCODER_GET_PRIVATE (encoder);
-  mfxSyncPoint syncp;
-  mfxStatus sts = MFX_ERR_NONE;
+  GstMfxEncoderStatus ret;
 
-  do {
-    sts = MFXVideoENCODE_EncodeFrameAsync (priv->session,
-        NULL, NULL, &priv->bs, &syncp);
+  while (g_queue_is_empty (&priv->encoded_frames)) {
+    if (!priv->inited)
+      return GST_MFX_ENCODER_STATUS_MORE_DATA;
 
-    if (MFX_WRN_DEVICE_BUSY == sts)
-      g_usleep (500);
-    else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts) {
-      priv->bs.MaxLength += 1024 * 16;
-      priv->bitstream = g_byte_array_set_size (priv->bitstream,
-          priv->bs.MaxLength);
-      priv->bs.Data = priv->bitstream->data;
-    }
-  } while (MFX_WRN_DEVICE_BUSY == sts || MFX_ERR_NOT_ENOUGH_BUFFER == sts);
-
-  if (MFX_ERR_NONE != sts)
-    return GST_MFX_ENCODER_STATUS_ERROR_OPERATION_FAILED;
-
-  if (syncp) {
-    do {
-      sts = MFXVideoCORE_SyncOperation (priv->session, syncp, 1000);
-    } while (MFX_WRN_IN_EXECUTION == sts);
-
-    if (MFX_ERR_NONE != sts)
-      return GST_MFX_ENCODER_STATUS_ERROR_OPERATION_FAILED;
-
-    *frame = g_slice_new0 (GstVideoCodecFrame);
-
-    (*frame)->output_buffer =
-        gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
-        priv->bs.Data, priv->bs.MaxLength,
-        priv->bs.DataOffset, priv->bs.DataLength, NULL, NULL);
-
-    calculate_new_pts_and_dts (encoder, *frame);
-
-    priv->bs.DataLength = 0;
+    ret = encode_frame_async (encoder, NULL, NULL);
+    /* Nothing left inside the encoder, drain in-flight operations */
+    if (GST_MFX_ENCODER_STATUS_MORE_DATA == ret)
+      ret = output_oldest_bitstream (encoder);
+    if (GST_MFX_ENCODER_STATUS_SUCCESS != ret)
+      return ret;
   }
 
-  if (priv->bs.FrameType & MFX_FRAMETYPE_IDR
-      || priv->bs.FrameType & MFX_FRAMETYPE_xIDR)
-    GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (*frame);
-  else
-    GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (*frame);
-
+  *frame = g_queue_pop_head (&priv->encoded_frames);
   return GST_MFX_ENCODER_STATUS_SUCCESS;
 }
 
@@ -177,9 +177,25 @@ GstMfxEncoderStatus gst_mfx_encoder_prepare (GstMfxEncoder * encoder);
 GstMfxEncoderStatus
 gst_mfx_encoder_encode (GstMfxEncoder * encoder, GstVideoCodecFrame * frame);
 
+gboolean
+gst_mfx_encoder_get_frame (GstMfxEncoder * encoder,
+    GstVideoCodecFrame ** out_frame);
+
 GstMfxEncoderStatus
 gst_mfx_encoder_flush (GstMfxEncoder * encoder, GstVideoCodecFrame ** frame);
 
+void
+gst_mfx_encoder_get_device_busy_stats (GstMfxEncoder * encoder,
+    guint64 * retries, guint64 * busy_time);
+
+GstMfxEncoderStatus
+gst_mfx_encoder_reconfigure_rate_control (GstMfxEncoder * encoder);
+
+void
+gst_mfx_encoder_get_reconfigure_stats (GstMfxEncoder * encoder,
+    guint64 * count, guint64 * reinits, guint64 * last_latency,
+    guint64 * max_latency);
+
 GType
 gst_mfx_encoder_get_type (void);
 
@@ -148,7 +148,6 @@ struct _GstMfxEncoderPrivate
   GstMfxTaskAggregator *aggregator;
   GstMfxTask *encode;
   GstMfxFilter *filter;
-  GByteArray *bitstream;
   gboolean encoder_memtype_is_system;
   gboolean input_memtype_is_system;
   gboolean shared;
@@ -157,9 +156,24 @@ struct _GstMfxEncoderPrivate
   mfxSession session;
   mfxVideoParam params;
   mfxFrameInfo frame_info;
-  mfxBitstream bs;
   GstVideoInfo info;
 
+  /* Output bitstreams, one per in-flight encode operation */
+  GQueue free_bitstreams;
+  GQueue pending_bitstreams;
+  GQueue encoded_frames;
+  GMutex completion_lock;
+  GCond completion_cond;
+  GstMfxDeviceBusy busy;
+  GstBufferPool *bitstream_pool;
+  guint bitstream_size;
+
+  /* Runtime reconfiguration statistics, in microseconds */
+  guint64 reconfigs;
+  guint64 reconfig_reinits;
+  guint64 reconfig_last_us;
+  guint64 reconfig_max_us;
+
   GstClockTime current_pts;
   GstClockTime duration;
 
@@ -190,6 +204,7 @@ struct _GstMfxEncoderPrivate
   mfxExtHEVCParam exthevc;
   mfxExtVideoSignalInfo extsig;
   mfxExtBuffer *extparam_internal[4];
+  mfxU16 num_extparam;
 
   /* H264 specific coding options */
   gboolean use_cabac;
@@ -47,6 +47,8 @@ struct _GstMfxFilter
   GstMfxTaskAggregator *aggregator;
   GstMfxTask *vpp[2];
   GstMfxSurfacePool *out_pool;
+  /* Most recent output surface, which may still be in flight */
+  GstMfxSurface *last_surface;
   gboolean inited;
 
   mfxSession session;
@@ -67,6 +69,8 @@ struct _GstMfxFilter
 
   mfxExtBuffer **ext_buffer;
   mfxExtVPPDoUse vpp_use;
+
+  GstMfxDeviceBusy busy;
 };
 
 G_DEFINE_TYPE (GstMfxFilter, gst_mfx_filter, GST_TYPE_OBJECT)
@@ -331,12 +335,28 @@ gst_mfx_filter_create (GstMfxFilter * filter,
   return TRUE;
 }
 
+/* Waits on every in-flight operation, then forgets the syncpoints of all
+ * output surfaces, downstream may hold them past a reset or close of the
+ * session. VPP operations complete in submission order */
+static void
+wait_output_surfaces (GstMfxFilter * filter)
+{
+  if (filter->last_surface) {
+    gst_mfx_surface_sync (filter->last_surface);
+    gst_mfx_surface_replace (&filter->last_surface, NULL);
+  }
+
+  if (filter->out_pool)
+    gst_mfx_surface_pool_clear_sync_points (filter->out_pool);
+}
+
 static void
 gst_mfx_filter_finalize (GObject * object)
 {
   GstMfxFilter *filter = GST_MFX_FILTER (object);
   guint i;
 
+  wait_output_surfaces (filter);
   MFXVideoVPP_Close (filter->session);
 
   gst_mfx_surface_pool_replace (&filter->out_pool, NULL);
@@ -1046,6 +1066,7 @@ gst_mfx_filter_reset (GstMfxFilter * filter)
   if (!filter->inited)
     return GST_MFX_FILTER_STATUS_SUCCESS;
 
+  wait_output_surfaces (filter);
   sts = MFXVideoVPP_Reset (filter->session, &filter->params);
   if (sts < 0) {
     GST_ERROR ("Error resetting MFX VPP %d", sts);
@@ -1103,6 +1124,32 @@ gst_mfx_filter_start (GstMfxFilter * filter)
   return GST_MFX_FILTER_STATUS_SUCCESS;
 }
 
+/* VPP keeps nothing in flight of its own, so while the device is busy the
+ * oldest work worth waiting on is whatever still produces the input */
+static gboolean
+sync_input_surface (gpointer data)
+{
+  GstMfxSurface *const surface = data;
+
+  if (!gst_mfx_surface_has_pending_sync (surface))
+    return FALSE;
+  return gst_mfx_surface_sync (surface);
+}
+
+/* Reports how often and for how long VPP had to wait for a busy device,
+ * in microseconds */
+void
+gst_mfx_filter_get_device_busy_stats (GstMfxFilter * filter,
+    guint64 * retries, guint64 * busy_time)
+{
+  g_return_if_fail (filter != NULL);
+
+  if (retries)
+    *retries = filter->busy.retries;
+  if (busy_time)
+    *busy_time = filter->busy.busy_time_us;
+}
+
 GstMfxFilterStatus
 gst_mfx_filter_process (GstMfxFilter * filter, GstMfxSurface * surface,
     GstMfxSurface ** out_surface)
@@ -1137,8 +1184,10 @@ gst_mfx_filter_process (GstMfxFilter * filter, GstMfxSurface * surface,
       sts = MFX_ERR_NONE;
 
     if (MFX_WRN_DEVICE_BUSY == sts)
-      g_usleep (500);
+      gst_mfx_task_aggregator_wait_device_busy (filter->aggregator,
+          &filter->busy, sync_input_surface, surface);
   } while (MFX_WRN_DEVICE_BUSY == sts);
+  gst_mfx_device_busy_reset (&filter->busy);
 
   if (MFX_ERR_MORE_DATA == sts)
     return GST_MFX_FILTER_STATUS_ERROR_MORE_DATA;
@@ -1157,17 +1206,14 @@ gst_mfx_filter_process (GstMfxFilter * filter, GstMfxSurface * surface,
   }
 
   if (syncp) {
-    if (!gst_mfx_task_has_type (filter->vpp[1], GST_MFX_TASK_ENCODER))
-      do {
-        sts = MFXVideoCORE_SyncOperation (filter->session, syncp, 1000);
-        if (MFX_ERR_NONE != sts && sts < 0) {
-          GST_ERROR ("MFXVideoCORE_SyncOperation() error status: %d", sts);
-          return GST_MFX_FILTER_STATUS_ERROR_OPERATION_FAILED;
-        }
-      } while (MFX_WRN_IN_EXECUTION == sts);
-
     *out_surface =
         gst_mfx_surface_pool_find_surface (filter->out_pool, outsurf);
+
+    /* Leave the wait to whoever reads the output on the CPU */
+    if (!gst_mfx_task_has_type (filter->vpp[1], GST_MFX_TASK_ENCODER)) {
+      gst_mfx_surface_set_sync_point (*out_surface, filter->session, syncp);
+      gst_mfx_surface_replace (&filter->last_surface, *out_surface);
+    }
   }
 
   if (more_surface)
@@ -261,5 +261,9 @@ gst_mfx_filter_set_async_depth (GstMfxFilter * filter, mfxU16 async_depth);
 gboolean
 gst_mfx_filter_set_iopattern_commit_to_task (GstMfxFilter * filter, mfxU16 iopattern);
 
+void
+gst_mfx_filter_get_device_busy_stats (GstMfxFilter * filter,
+    guint64 * retries, guint64 * busy_time);
+
 G_END_DECLS
 #endif /* GST_MFX_FILTER_H */
@@ -170,6 +170,10 @@ gst_mfx_prime_buffer_proxy_new_from_surface (GstMfxSurface * surface)
 
   g_return_val_if_fail (surface != NULL, NULL);
 
+  /* The importer has no way to wait on pending MFX operations */
+  if (!gst_mfx_surface_sync (surface))
+    return NULL;
+
   proxy = g_object_new (GST_TYPE_MFX_PRIME_BUFFER_PROXY, NULL);
   if (!proxy)
     return NULL;
@@ -22,6 +22,7 @@
 #include "gstmfxsurface_priv.h"
 #include "gstmfxsurfacepool.h"
 #include "video-format.h"
+#include "common/gstmfxcopy.h"
 
 #define DEBUG 1
 #include "gstmfxdebug.h"
@@ -31,53 +32,157 @@ GST_DEBUG_CATEGORY (gst_debug_mfx);
 G_DEFINE_TYPE_WITH_CODE (GstMfxSurface, gst_mfx_surface, GST_TYPE_OBJECT,
     G_ADD_PRIVATE (GstMfxSurface));
 
+#ifndef GST_MFX_SURFACE_PITCH_ALIGNMENT
+# define GST_MFX_SURFACE_PITCH_ALIGNMENT 64
+#endif
+
+/* System memory planes are aligned for SIMD loads and stores */
+#define SURFACE_DATA_ALIGNMENT 64
+
+/* Freed frame buffers are cached by size class so that surfaces of the
+ * same format and size are recycled across pools instead of hitting
+ * malloc for every new surface */
+#define SLAB_CLASS_GRANULARITY 4096
+#define SLAB_MAX_BLOCKS_PER_CLASS 16
+#define SLAB_MAX_CACHED_BYTES (256 * 1024 * 1024)
+
+static GMutex slab_lock;
+static GHashTable *slab_classes;
+static gsize slab_cached_bytes;
+
+static gsize
+slab_class_size (gsize size)
+{
+  return GST_ROUND_UP_N (size, SLAB_CLASS_GRANULARITY);
+}
+
+static guint8 *
+slab_block_new (gsize size)
+{
+  guint8 *mem, *data;
+
+  mem = g_try_malloc (size + SURFACE_DATA_ALIGNMENT + sizeof (gpointer));
+  if (!mem)
+    return NULL;
+
+  /* Keep the start of the allocation just before the aligned data */
+  data = (guint8 *) GST_ROUND_UP_N ((guintptr) mem + sizeof (gpointer),
+      SURFACE_DATA_ALIGNMENT);
+  ((gpointer *) data)[-1] = mem;
+  return data;
+}
+
+static void
+slab_block_free (guint8 * data)
+{
+  g_free (((gpointer *) data)[-1]);
+}
+
+static guint8 *
+slab_alloc (gsize size)
+{
+  GQueue *blocks;
+  guint8 *data = NULL;
+
+  size = slab_class_size (size);
+
+  g_mutex_lock (&slab_lock);
+  if (slab_classes) {
+    blocks = g_hash_table_lookup (slab_classes, GSIZE_TO_POINTER (size));
+    if (blocks)
+      data = g_queue_pop_head (blocks);
+    if (data)
+      slab_cached_bytes -= size;
+  }
+  g_mutex_unlock (&slab_lock);
+
+  if (!data)
+    data = slab_block_new (size);
+  return data;
+}
+
+static void
+slab_free (guint8 * data, gsize size)
+{
+  GQueue *blocks;
+
+  size = slab_class_size (size);
+
+  g_mutex_lock (&slab_lock);
+  if (!slab_classes)
+    slab_classes = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  blocks = g_hash_table_lookup (slab_classes, GSIZE_TO_POINTER (size));
+  if (!blocks) {
+    blocks = g_queue_new ();
+    g_hash_table_insert (slab_classes, GSIZE_TO_POINTER (size), blocks);
+  }
+
+  if (blocks->length < SLAB_MAX_BLOCKS_PER_CLASS
+      && slab_cached_bytes + size <= SLAB_MAX_CACHED_BYTES) {
+    g_queue_push_head (blocks, data);
+    slab_cached_bytes += size;
+    data = NULL;
+  }
+  g_mutex_unlock (&slab_lock);
+
+  if (data)
+    slab_block_free (data);
+}
+
 static gboolean
 gst_mfx_surface_allocate_default (GstMfxSurface * surface, GstMfxTask * task)
 {
   GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
   mfxFrameData *ptr = &priv->surface.Data;
   mfxFrameInfo *info = &priv->surface.Info;
-  guint frame_size;
+  guint pitch, plane_size;
   gboolean success = TRUE;
 
-  frame_size = info->Width * info->Height;
-
   switch (info->FourCC) {
     case MFX_FOURCC_NV12:
-      priv->data_size = frame_size * 3 / 2;
-      priv->data = g_slice_alloc (priv->data_size);
+      pitch = GST_ROUND_UP_N (info->Width, GST_MFX_SURFACE_PITCH_ALIGNMENT);
+      plane_size = pitch * info->Height;
+      priv->data_size = plane_size * 3 / 2;
+      priv->data = slab_alloc (priv->data_size);
       if (!priv->data)
         goto error;
-      ptr->Pitch = priv->pitches[0] = priv->pitches[1] = info->Width;
+      ptr->Pitch = priv->pitches[0] = priv->pitches[1] = pitch;
 
       priv->planes[0] = ptr->Y = priv->data;
-      priv->planes[1] = ptr->UV = ptr->Y + frame_size;
+      priv->planes[1] = ptr->UV = ptr->Y + plane_size;
 
       break;
     case MFX_FOURCC_YV12:
-      priv->data_size = frame_size * 3 / 2;
-      priv->data = g_slice_alloc (priv->data_size);
+      /* Keep chroma rows aligned as well */
+      pitch = GST_ROUND_UP_N (info->Width,
+          2 * GST_MFX_SURFACE_PITCH_ALIGNMENT);
+      plane_size = pitch * info->Height;
+      priv->data_size = plane_size * 3 / 2;
+      priv->data = slab_alloc (priv->data_size);
       if (!priv->data)
         goto error;
-      ptr->Pitch = priv->pitches[0] = info->Width;
+      ptr->Pitch = priv->pitches[0] = pitch;
       priv->pitches[1] = priv->pitches[2] = ptr->Pitch / 2;
 
       priv->planes[0] = ptr->Y = priv->data;
       if (priv->format == GST_VIDEO_FORMAT_I420) {
-        priv->planes[1] = ptr->U = ptr->Y + frame_size;
-        priv->planes[2] = ptr->V = ptr->U + (frame_size / 4);
+        priv->planes[1] = ptr->U = ptr->Y + plane_size;
+        priv->planes[2] = ptr->V = ptr->U + (plane_size / 4);
       } else {
-        priv->planes[1] = ptr->V = ptr->Y + frame_size;
-        priv->planes[2] = ptr->U = ptr->V + (frame_size / 4);
+        priv->planes[1] = ptr->V = ptr->Y + plane_size;
+        priv->planes[2] = ptr->U = ptr->V + (plane_size / 4);
       }
 
       break;
     case MFX_FOURCC_YUY2:
-      priv->data_size = frame_size * 2;
-      priv->data = g_slice_alloc (priv->data_size);
+      pitch = GST_ROUND_UP_N (info->Width * 2,
+          GST_MFX_SURFACE_PITCH_ALIGNMENT);
+      priv->data_size = pitch * info->Height;
+      priv->data = slab_alloc (priv->data_size);
       if (!priv->data)
         goto error;
-      ptr->Pitch = priv->pitches[0] = info->Width * 2;
+      ptr->Pitch = priv->pitches[0] = pitch;
 
       priv->planes[0] = ptr->Y = priv->data;
       ptr->U = ptr->Y + 1;
@@ -85,11 +190,13 @@ gst_mfx_surface_allocate_default (GstMfxSurface * surface, GstMfxTask * task)
 
       break;
     case MFX_FOURCC_UYVY:
-      priv->data_size = frame_size * 2;
-      priv->data = g_slice_alloc (priv->data_size);
+      pitch = GST_ROUND_UP_N (info->Width * 2,
+          GST_MFX_SURFACE_PITCH_ALIGNMENT);
+      priv->data_size = pitch * info->Height;
+      priv->data = slab_alloc (priv->data_size);
       if (!priv->data)
         goto error;
-      ptr->Pitch = priv->pitches[0] = info->Width * 2;
+      ptr->Pitch = priv->pitches[0] = pitch;
 
       priv->planes[0] = ptr->U = priv->data;
       ptr->Y = ptr->U + 1;
@@ -98,11 +205,13 @@ gst_mfx_surface_allocate_default (GstMfxSurface * surface, GstMfxTask * task)
       break;
     case MFX_FOURCC_RGB4:
     case MFX_FOURCC_A2RGB10:
-      priv->data_size = frame_size * 4;
-      priv->data = g_slice_alloc (priv->data_size);
+      pitch = GST_ROUND_UP_N (info->Width * 4,
+          GST_MFX_SURFACE_PITCH_ALIGNMENT);
+      priv->data_size = pitch * info->Height;
+      priv->data = slab_alloc (priv->data_size);
       if (!priv->data)
         goto error;
-      ptr->Pitch = priv->pitches[0] = info->Width * 4;
+      ptr->Pitch = priv->pitches[0] = pitch;
 
       priv->planes[0] = ptr->B = priv->data;
       ptr->G = ptr->B + 1;
@@ -111,14 +220,17 @@ gst_mfx_surface_allocate_default (GstMfxSurface * surface, GstMfxTask * task)
 
       break;
     case MFX_FOURCC_P010:
-      priv->data_size = frame_size * 3;
-      priv->data = g_slice_alloc (priv->data_size);
+      pitch = GST_ROUND_UP_N (info->Width * 2,
+          GST_MFX_SURFACE_PITCH_ALIGNMENT);
+      plane_size = pitch * info->Height;
+      priv->data_size = plane_size * 3 / 2;
+      priv->data = slab_alloc (priv->data_size);
       if (!priv->data)
         goto error;
-      ptr->Pitch = priv->pitches[0] = priv->pitches[1] = info->Width * 2;
+      ptr->Pitch = priv->pitches[0] = priv->pitches[1] = pitch;
 
       priv->planes[0] = ptr->Y = priv->data;
-      priv->planes[1] = ptr->UV = ptr->Y + frame_size * 2;
+      priv->planes[1] = ptr->UV = ptr->Y + plane_size;
 
       break;
     default:
@@ -141,7 +253,16 @@ gst_mfx_surface_release_default (GstMfxSurface * surface)
   if (NULL != ptr) {
     ptr->Pitch = 0;
     if (priv->data)
-      g_slice_free1 (priv->data_size, priv->data);
+      slab_free (priv->data, priv->data_size);
+    priv->data = NULL;
+    if (priv->wrapped_frame) {
+      GstBuffer *const buffer = priv->wrapped_frame->buffer;
+
+      gst_video_frame_unmap (priv->wrapped_frame);
+      gst_buffer_unref (buffer);
+      g_slice_free (GstVideoFrame, priv->wrapped_frame);
+      priv->wrapped_frame = NULL;
+    }
     ptr->Y = NULL;
     ptr->U = NULL;
     ptr->V = NULL;
@@ -201,6 +322,7 @@ gst_mfx_surface_init (GstMfxSurface * surface)
   GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
 
   priv->surface_id = GST_MFX_ID_INVALID;
+  g_mutex_init (&priv->sync_lock);
 }
 
 static gboolean
@@ -257,6 +379,7 @@ gst_mfx_surface_finalize (GObject * object)
     klass->release (surface);
   gst_mfx_task_replace (&priv->task, NULL);
   gst_mfx_context_replace (&priv->context, NULL);
+  g_mutex_clear (&priv->sync_lock);
 
   G_OBJECT_CLASS (gst_mfx_surface_parent_class)->finalize (object);
 }
@@ -309,6 +432,102 @@ gst_mfx_surface_new_from_pool (GstMfxSurfacePool * pool)
   return gst_mfx_surface_pool_get_surface (pool);
 }
 
+/* Points the frame surface at the planes of a mapped system memory frame
+ * if they are laid out the way MSDK expects */
+static gboolean
+gst_mfx_surface_wrap_frame (GstMfxSurface * surface, GstVideoFrame * frame)
+{
+  GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
+  mfxFrameData *ptr = &priv->surface.Data;
+  mfxFrameInfo *info = &priv->surface.Info;
+  guint8 *const end = frame->map[0].data + frame->map[0].size;
+  guint8 *planes[2];
+  guint pitch;
+
+  gst_mfx_surface_derive_mfx_frame_info (surface, &frame->info);
+  priv->format = GST_VIDEO_FRAME_FORMAT (frame);
+
+  planes[0] = GST_VIDEO_FRAME_PLANE_DATA (frame, 0);
+  pitch = GST_VIDEO_FRAME_PLANE_STRIDE (frame, 0);
+  if (((guintptr) planes[0] | pitch) & 15 || pitch > G_MAXUINT16
+      || pitch < info->Width * GST_VIDEO_FRAME_COMP_PSTRIDE (frame, 0))
+    return FALSE;
+
+  switch (info->FourCC) {
+    case MFX_FOURCC_NV12:
+    case MFX_FOURCC_P010:
+      /* MSDK addresses the chroma plane through the luma pitch, and may
+       * read up to the aligned surface height in both planes */
+      planes[1] = GST_VIDEO_FRAME_PLANE_DATA (frame, 1);
+      if (GST_VIDEO_FRAME_PLANE_STRIDE (frame, 1) != pitch
+          || (guintptr) planes[1] & 15
+          || planes[1] < planes[0] + pitch * info->Height
+          || end < planes[1] + pitch * info->Height / 2)
+        return FALSE;
+      ptr->Y = planes[0];
+      ptr->UV = planes[1];
+      priv->planes[1] = planes[1];
+      priv->pitches[1] = pitch;
+      break;
+    case MFX_FOURCC_YUY2:
+      if (end < planes[0] + pitch * info->Height)
+        return FALSE;
+      ptr->Y = planes[0];
+      ptr->U = ptr->Y + 1;
+      ptr->V = ptr->Y + 3;
+      break;
+    case MFX_FOURCC_UYVY:
+      if (end < planes[0] + pitch * info->Height)
+        return FALSE;
+      ptr->U = planes[0];
+      ptr->Y = ptr->U + 1;
+      ptr->V = ptr->U + 2;
+      break;
+    case MFX_FOURCC_RGB4:
+    case MFX_FOURCC_A2RGB10:
+      if (end < planes[0] + pitch * info->Height)
+        return FALSE;
+      ptr->B = planes[0];
+      ptr->G = ptr->B + 1;
+      ptr->R = ptr->B + 2;
+      ptr->A = ptr->B + 3;
+      break;
+    default:
+      return FALSE;
+  }
+
+  ptr->Pitch = priv->pitches[0] = pitch;
+  priv->planes[0] = planes[0];
+  priv->has_video_memory = FALSE;
+
+  priv->wrapped_frame = g_slice_dup (GstVideoFrame, frame);
+  gst_buffer_ref (frame->buffer);
+
+  gst_mfx_surface_init_properties (surface);
+  return TRUE;
+}
+
+/* Wraps the planes of a frame mapped for reading without copying them.
+ * On success the surface owns the mapping and keeps the buffer alive,
+ * otherwise the caller still has to unmap the frame */
+GstMfxSurface *
+gst_mfx_surface_new_wrapped (GstVideoFrame * frame)
+{
+  GstMfxSurface *surface;
+
+  g_return_val_if_fail (frame != NULL, NULL);
+
+  surface = g_object_new (GST_TYPE_MFX_SURFACE, NULL);
+  if (!surface)
+    return NULL;
+
+  if (!gst_mfx_surface_wrap_frame (surface, frame)) {
+    gst_mfx_surface_unref (surface);
+    return NULL;
+  }
+  return surface;
+}
+
 GstMfxSurface *
 gst_mfx_surface_new_internal (GstMfxSurface * surface, GstMfxContext * context,
     const GstVideoInfo * info, GstMfxTask * task)
@@ -472,6 +691,34 @@ gst_mfx_surface_get_data_size (GstMfxSurface * surface)
   return GST_MFX_SURFACE_GET_PRIVATE (surface)->data_size;
 }
 
+/* Copies the pixels of @src into @dst, which must be mapped and of the
+ * same format. Pitches of both surfaces are honoured, so planes padded
+ * differently by the allocators are copied row by row */
+void
+gst_mfx_surface_copy_data (GstMfxSurface * dst, GstMfxSurface * src)
+{
+  GstVideoInfo info;
+  guint i;
+
+  g_return_if_fail (dst != NULL);
+  g_return_if_fail (src != NULL);
+
+  gst_video_info_init (&info);
+  gst_video_info_set_format (&info, gst_mfx_surface_get_format (src),
+      MIN (gst_mfx_surface_get_width (src), gst_mfx_surface_get_width (dst)),
+      MIN (gst_mfx_surface_get_height (src),
+          gst_mfx_surface_get_height (dst)));
+
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (&info); i++)
+    gst_mfx_copy_plane_memcpy (gst_mfx_surface_get_plane (dst, i),
+        gst_mfx_surface_get_pitch (dst, i),
+        gst_mfx_surface_get_plane (src, i),
+        gst_mfx_surface_get_pitch (src, i),
+        GST_VIDEO_INFO_COMP_WIDTH (&info, i) *
+        GST_VIDEO_INFO_COMP_PSTRIDE (&info, i),
+        GST_VIDEO_INFO_COMP_HEIGHT (&info, i));
+}
+
 GstMfxContext *
 gst_mfx_surface_get_context (GstMfxSurface * surface)
 {
@@ -490,12 +737,19 @@ gst_mfx_surface_has_video_memory (GstMfxSurface * surface)
   return GST_MFX_SURFACE_GET_PRIVATE (surface)->has_video_memory;
 }
 
+/* @flags tell the backend whether the CPU is going to write to the
+ * surface, in which case the mapping is released on unmap */
 gboolean
-gst_mfx_surface_map (GstMfxSurface * surface)
+gst_mfx_surface_map (GstMfxSurface * surface, GstMapFlags flags)
 {
   GstMfxSurfaceClass *const klass = GST_MFX_SURFACE_GET_CLASS (surface);
   GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
 
+  if (!gst_mfx_surface_sync (surface))
+    return FALSE;
+
+  priv->map_flags |= flags;
+
   if (gst_mfx_surface_has_video_memory (surface) && !priv->mapped)
     if (klass->map)
       return (priv->mapped = klass->map (surface));
@@ -514,4 +768,86 @@ gst_mfx_surface_unmap (GstMfxSurface * surface)
       klass->unmap (surface);
       priv->mapped = FALSE;
     }
+  priv->map_flags = 0;
+}
+
+/* Drops any CPU mapping kept alive across map/unmap cycles, to be called
+ * before the surface gets written to by the hardware again */
+void
+gst_mfx_surface_invalidate (GstMfxSurface * surface)
+{
+  GstMfxSurfaceClass *const klass = GST_MFX_SURFACE_GET_CLASS (surface);
+  GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
+
+  if (gst_mfx_surface_has_video_memory (surface) && klass->invalidate) {
+    klass->invalidate (surface);
+    priv->mapped = FALSE;
+    priv->map_flags = 0;
+  }
+}
+
+/* Records the operation that produces the surface content. MFX components
+ * sharing the producer's joined session can consume the surface right away,
+ * since the SDK tracks dependencies between joined sessions on its own.
+ * Anything else touching the surface has to call gst_mfx_surface_sync()
+ * first. Passing a NULL syncp drops the pending operation */
+void
+gst_mfx_surface_set_sync_point (GstMfxSurface * surface, mfxSession session,
+    mfxSyncPoint syncp)
+{
+  GstMfxSurfacePrivate *priv;
+
+  g_return_if_fail (surface != NULL);
+
+  priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
+
+  g_mutex_lock (&priv->sync_lock);
+  priv->sync_session = syncp ? session : NULL;
+  priv->syncp = syncp;
+  g_mutex_unlock (&priv->sync_lock);
+}
+
+gboolean
+gst_mfx_surface_has_pending_sync (GstMfxSurface * surface)
+{
+  GstMfxSurfacePrivate *priv;
+  gboolean pending;
+
+  g_return_val_if_fail (surface != NULL, FALSE);
+
+  priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
+
+  g_mutex_lock (&priv->sync_lock);
+  pending = priv->syncp != NULL;
+  g_mutex_unlock (&priv->sync_lock);
+  return pending;
+}
+
+/* Blocks until the operation producing the surface has completed */
+gboolean
+gst_mfx_surface_sync (GstMfxSurface * surface)
+{
+  GstMfxSurfacePrivate *priv;
+  mfxStatus sts = MFX_ERR_NONE;
+
+  g_return_val_if_fail (surface != NULL, FALSE);
+
+  priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
+
+  g_mutex_lock (&priv->sync_lock);
+  if (priv->syncp) {
+    do {
+      sts = MFXVideoCORE_SyncOperation (priv->sync_session, priv->syncp,
+          1000);
+    } while (MFX_WRN_IN_EXECUTION == sts);
+
+    if (MFX_ERR_NONE != sts)
+      GST_ERROR ("MFXVideoCORE_SyncOperation() error status: %d", sts);
+
+    priv->sync_session = NULL;
+    priv->syncp = NULL;
+  }
+  g_mutex_unlock (&priv->sync_lock);
+
+  return MFX_ERR_NONE == sts;
 }
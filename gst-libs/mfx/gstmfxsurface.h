@@ -59,6 +59,9 @@ gst_mfx_surface_new_from_task (GstMfxTask * task);
 GstMfxSurface *
 gst_mfx_surface_new_from_pool (GstMfxSurfacePool * pool);
 
+GstMfxSurface *
+gst_mfx_surface_new_wrapped (GstVideoFrame * frame);
+
 GstMfxSurface *
 gst_mfx_surface_copy (GstMfxSurface * surface);
 
@@ -100,6 +103,9 @@ gst_mfx_surface_get_pitch (GstMfxSurface * surface, guint plane);
 guint
 gst_mfx_surface_get_data_size (GstMfxSurface * surface);
 
+void
+gst_mfx_surface_copy_data (GstMfxSurface * dst, GstMfxSurface * src);
+
 GstMfxRectangle *
 gst_mfx_surface_get_crop_rect (GstMfxSurface * surface);
 
@@ -110,10 +116,23 @@ gboolean
 gst_mfx_surface_has_video_memory (GstMfxSurface * surface);
 
 gboolean
-gst_mfx_surface_map (GstMfxSurface * surface);
+gst_mfx_surface_map (GstMfxSurface * surface, GstMapFlags flags);
 
 void
 gst_mfx_surface_unmap (GstMfxSurface * surface);
 
+void
+gst_mfx_surface_invalidate (GstMfxSurface * surface);
+
+void
+gst_mfx_surface_set_sync_point (GstMfxSurface * surface, mfxSession session,
+    mfxSyncPoint syncp);
+
+gboolean
+gst_mfx_surface_has_pending_sync (GstMfxSurface * surface);
+
+gboolean
+gst_mfx_surface_sync (GstMfxSurface * surface);
+
 G_END_DECLS
 #endif /* GST_MFX_SURFACE_H */
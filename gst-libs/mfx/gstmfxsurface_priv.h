@@ -50,16 +50,24 @@ struct _GstMfxSurfacePrivate
   guint height;
   guint data_size;
   guint8 *data;
+  GstVideoFrame *wrapped_frame;
   guchar *planes[3];
   guint16 pitches[3];
   gboolean mapped;
+  GstMapFlags map_flags;
   gboolean has_video_memory;
+
+  /* Operation still writing to the surface, waited on by CPU users */
+  GMutex sync_lock;
+  mfxSession sync_session;
+  mfxSyncPoint syncp;
 };
 
 typedef gboolean (*GstMfxSurfaceAllocateFunc) (GstMfxSurface * surface, GstMfxTask * task);
 typedef void (*GstMfxSurfaceReleaseFunc) (GstMfxSurface * surface);
 typedef gboolean (*GstMfxSurfaceMapFunc) (GstMfxSurface * surface);
 typedef void (*GstMfxSurfaceUnmapFunc) (GstMfxSurface * surface);
+typedef void (*GstMfxSurfaceInvalidateFunc) (GstMfxSurface * surface);
 
 struct _GstMfxSurfaceClass
 {
@@ -71,6 +79,7 @@ struct _GstMfxSurfaceClass
   GstMfxSurfaceReleaseFunc release;
   GstMfxSurfaceMapFunc map;
   GstMfxSurfaceUnmapFunc unmap;
+  GstMfxSurfaceInvalidateFunc invalidate;
 };
 
 GstMfxSurface *
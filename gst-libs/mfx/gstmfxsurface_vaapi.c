@@ -23,6 +23,7 @@
 #include "video-format.h"
 #include "gstmfxprimebufferproxy.h"
 #include <va/va_drmcommon.h>
+#include <unistd.h>
 
 #define DEBUG 1
 #include "gstmfxdebug.h"
@@ -36,10 +37,18 @@ struct _GstMfxSurfaceVaapi
 
   GstMfxDisplay *display;
   VaapiImage *image;
+  guint map_hits;
+  guint map_misses;
 };
 
 G_DEFINE_TYPE (GstMfxSurfaceVaapi, gst_mfx_surface_vaapi, GST_TYPE_MFX_SURFACE);
 
+/* The derived image of a surface stays mapped after a read-only map,
+ * until the surface is handed out again by its pool. Mappings the CPU
+ * wrote through are released on unmap so the GPU sees the new data */
+static volatile gint map_cache_hits;
+static volatile gint map_cache_misses;
+
 static gboolean
 gst_mfx_surface_vaapi_from_task (GstMfxSurface * surface, GstMfxTask * task)
 {
@@ -120,11 +129,20 @@ gst_mfx_surface_vaapi_map (GstMfxSurface * surface)
   GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
   GstMfxSurfaceVaapi *const vaapi_surface =
       GST_MFX_SURFACE_VAAPI_CAST (surface);
+  VaapiImage *image;
   guint i, num_planes;
   gboolean success = TRUE;
 
-  vaapi_surface->image = gst_mfx_surface_vaapi_derive_image (surface);
-  if (!vaapi_surface->image)
+  if (priv->planes[0]) {
+    vaapi_surface->map_hits++;
+    g_atomic_int_inc (&map_cache_hits);
+    return TRUE;
+  }
+  vaapi_surface->map_misses++;
+  g_atomic_int_inc (&map_cache_misses);
+
+  image = gst_mfx_surface_vaapi_derive_image (surface);
+  if (!image)
     return FALSE;
 
   if (!vaapi_image_map (vaapi_surface->image)) {
@@ -147,29 +165,50 @@ gst_mfx_surface_vaapi_map (GstMfxSurface * surface)
   }
 
 done:
-  vaapi_image_unref (vaapi_surface->image);
+  vaapi_image_unref (image);
   return success;
 }
 
 static void
-gst_mfx_surface_vaapi_unmap (GstMfxSurface * surface)
+gst_mfx_surface_vaapi_invalidate (GstMfxSurface * surface)
 {
   GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
   GstMfxSurfaceVaapi *const vaapi_surface =
       GST_MFX_SURFACE_VAAPI_CAST (surface);
-  guint i, num_planes;
+  guint i;
 
-  num_planes = vaapi_image_get_plane_count (vaapi_surface->image);
-  for (i = 0; i < num_planes; i++) {
+  if (!vaapi_surface->image || !priv->planes[0])
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS (priv->planes); i++) {
     priv->planes[i] = NULL;
     priv->pitches[i] = 0;
   }
   vaapi_image_unmap (vaapi_surface->image);
 }
 
+static void
+gst_mfx_surface_vaapi_unmap (GstMfxSurface * surface)
+{
+  GstMfxSurfacePrivate *const priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
+
+  /* Read-only mappings stay cached, see gst_mfx_surface_vaapi_invalidate () */
+  if (priv->map_flags & GST_MAP_WRITE)
+    gst_mfx_surface_vaapi_invalidate (surface);
+}
+
 static void
 gst_mfx_surface_vaapi_finalize (GObject * object)
 {
+  GstMfxSurfaceVaapi *const vaapi_surface =
+      GST_MFX_SURFACE_VAAPI_CAST (object);
+
+  if (vaapi_surface->map_hits || vaapi_surface->map_misses)
+    GST_INFO ("VA surface %p map cache: %u hits, %u misses (process: %d/%d)",
+        object, vaapi_surface->map_hits, vaapi_surface->map_misses,
+        g_atomic_int_get (&map_cache_hits),
+        g_atomic_int_get (&map_cache_misses));
+
   G_OBJECT_CLASS (gst_mfx_surface_vaapi_parent_class)->finalize (object);
 }
 
@@ -185,6 +224,7 @@ gst_mfx_surface_vaapi_class_init (GstMfxSurfaceVaapiClass * klass)
   surface_class->release = gst_mfx_surface_vaapi_release;
   surface_class->map = gst_mfx_surface_vaapi_map;
   surface_class->unmap = gst_mfx_surface_vaapi_unmap;
+  surface_class->invalidate = gst_mfx_surface_vaapi_invalidate;
 }
 
 static void
@@ -320,6 +360,139 @@ gst_mfx_surface_vaapi_new_with_dma_buf_handle (GstMfxContext * context, gint fd,
   return gst_mfx_surface_vaapi_new_from_buffer_proxy (context, proxy, vi);
 }
 
+static gsize
+get_dma_buf_size (gint fd)
+{
+  off_t size = lseek (fd, 0, SEEK_END);
+
+  return size > 0 ? (gsize) size : 0;
+}
+
+#if VA_CHECK_VERSION(1,1,0)
+/* Imports planes spread across several dmabufs as a single layer. Only
+ * formats whose DRM fourcc matches the VA one are handled */
+static GstMfxSurface *
+gst_mfx_surface_vaapi_new_from_prime2 (GstMfxContext * context,
+    const GstVideoInfo * info, const gint fds[], const gsize offsets[],
+    const gint strides[])
+{
+  GstMfxSurface *surface;
+  GstMfxSurfaceVaapi *vaapi_surface;
+  GstMfxSurfacePrivate *priv;
+  mfxFrameInfo *frame_info;
+  VADRMPRIMESurfaceDescriptor desc;
+  VASurfaceAttrib attribs[2];
+  guint i, j, fourcc;
+  VAStatus sts;
+
+  surface = gst_mfx_surface_vaapi_new_external (context, info);
+  if (!surface)
+    return NULL;
+
+  priv = GST_MFX_SURFACE_GET_PRIVATE (surface);
+  vaapi_surface = GST_MFX_SURFACE_VAAPI_CAST (surface);
+  vaapi_surface->display = gst_mfx_context_get_device (priv->context);
+  priv->has_video_memory = TRUE;
+  frame_info = &priv->surface.Info;
+
+  fourcc = gst_mfx_video_format_to_va_fourcc (frame_info->FourCC);
+  if (fourcc != VA_FOURCC_NV12 && fourcc != VA_FOURCC_P010) {
+    GST_ERROR ("Unsupported color format for multi-fd import");
+    goto error;
+  }
+
+  memset (&desc, 0, sizeof (desc));
+  desc.fourcc = fourcc;
+  desc.width = GST_VIDEO_INFO_WIDTH (info);
+  desc.height = GST_VIDEO_INFO_HEIGHT (info);
+  desc.num_layers = 1;
+  desc.layers[0].drm_format = fourcc;
+  desc.layers[0].num_planes = GST_VIDEO_INFO_N_PLANES (info);
+
+  for (i = 0; i < desc.layers[0].num_planes; i++) {
+    for (j = 0; j < desc.num_objects; j++)
+      if (desc.objects[j].fd == fds[i])
+        break;
+    if (j == desc.num_objects) {
+      desc.objects[j].fd = fds[i];
+      desc.objects[j].size = get_dma_buf_size (fds[i]);
+      desc.num_objects++;
+    }
+    desc.layers[0].object_index[i] = j;
+    desc.layers[0].offset[i] = offsets[i];
+    desc.layers[0].pitch[i] = strides[i];
+  }
+
+  memset (&attribs, 0, sizeof (attribs));
+  attribs[0].type = VASurfaceAttribMemoryType;
+  attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+  attribs[0].value.type = VAGenericValueTypeInteger;
+  attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2;
+  attribs[1].type = VASurfaceAttribExternalBufferDescriptor;
+  attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+  attribs[1].value.type = VAGenericValueTypePointer;
+  attribs[1].value.value.p = &desc;
+
+  GST_MFX_DISPLAY_LOCK (vaapi_surface->display);
+  sts = vaCreateSurfaces (GST_MFX_DISPLAY_VADISPLAY (vaapi_surface->display),
+      gst_mfx_video_format_to_va_format (frame_info->FourCC),
+      desc.width, desc.height, (VASurfaceID *) & priv->surface_id, 1,
+      attribs, 2);
+  GST_MFX_DISPLAY_UNLOCK (vaapi_surface->display);
+  if (!vaapi_check_status (sts, "vaCreateSurfaces ()"))
+    goto error;
+
+  priv->mem_id.mid = &priv->surface_id;
+  priv->mem_id.info = frame_info;
+  priv->surface.Data.MemId = &priv->mem_id;
+  return surface;
+
+error:
+  priv->surface_id = VA_INVALID_ID;
+  gst_mfx_surface_unref (surface);
+  return NULL;
+}
+#endif
+
+/* Imports a frame whose planes live at the given dmabuf fds, offsets and
+ * pitches, typically taken from a GstVideoMeta */
+GstMfxSurface *
+gst_mfx_surface_vaapi_new_with_dma_buf_planes (GstMfxContext * context,
+    const GstVideoInfo * info, const gint fds[], const gsize offsets[],
+    const gint strides[])
+{
+  GstVideoInfo vi;
+  guint i;
+
+  g_return_val_if_fail (context != NULL, NULL);
+  g_return_val_if_fail (info != NULL, NULL);
+
+  for (i = 1; i < GST_VIDEO_INFO_N_PLANES (info); i++)
+    if (fds[i] != fds[0])
+      break;
+
+  if (i < GST_VIDEO_INFO_N_PLANES (info)) {
+#if VA_CHECK_VERSION(1,1,0)
+    return gst_mfx_surface_vaapi_new_from_prime2 (context, info, fds,
+        offsets, strides);
+#else
+    GST_ERROR ("multi-fd dmabuf import requires VA-API 1.1");
+    return NULL;
+#endif
+  }
+
+  /* Single dmabuf, only the layout differs from the default one */
+  vi = *info;
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (&vi); i++) {
+    GST_VIDEO_INFO_PLANE_OFFSET (&vi, i) = offsets[i];
+    GST_VIDEO_INFO_PLANE_STRIDE (&vi, i) = strides[i];
+  }
+  GST_VIDEO_INFO_SIZE (&vi) = MAX (get_dma_buf_size (fds[0]),
+      GST_VIDEO_INFO_SIZE (info));
+
+  return gst_mfx_surface_vaapi_new_with_dma_buf_handle (context, fds[0], &vi);
+}
+
 GstMfxSurface *
 gst_mfx_surface_vaapi_new (GstMfxContext * context, const GstVideoInfo * info)
 {
@@ -393,3 +566,12 @@ gst_mfx_surface_vaapi_get_display (GstMfxSurface * surface)
 
   return gst_mfx_display_ref (GST_MFX_SURFACE_VAAPI_CAST (surface)->display);
 }
+
+void
+gst_mfx_surface_vaapi_get_map_cache_stats (guint * hits, guint * misses)
+{
+  if (hits)
+    *hits = g_atomic_int_get (&map_cache_hits);
+  if (misses)
+    *misses = g_atomic_int_get (&map_cache_misses);
+}
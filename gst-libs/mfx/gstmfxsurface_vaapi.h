@@ -52,5 +52,13 @@ gst_mfx_surface_vaapi_new_from_buffer_proxy (GstMfxContext * context, GstMfxPrim
 GstMfxSurface *
 gst_mfx_surface_vaapi_new_with_dma_buf_handle (GstMfxContext * context, gint fd, GstVideoInfo *vi);
 
+GstMfxSurface *
+gst_mfx_surface_vaapi_new_with_dma_buf_planes (GstMfxContext * context,
+    const GstVideoInfo * info, const gint fds[], const gsize offsets[],
+    const gint strides[]);
+
+void
+gst_mfx_surface_vaapi_get_map_cache_stats (guint * hits, guint * misses);
+
 G_END_DECLS
 #endif /* GST_MFX_SURFACE_VAAPI_H */
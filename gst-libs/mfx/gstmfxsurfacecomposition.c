@@ -24,6 +24,7 @@
 
 #include "gstmfxsurfacecomposition.h"
 #include "gstmfxsurface.h"
+#include "common/gstmfxcopy.h"
 
 #ifdef WITH_LIBVA_BACKEND
 # include "gstmfxsurface_vaapi.h"
@@ -105,22 +106,11 @@ create_subpicture (GstMfxSurfaceComposition * composition,
       (gint *) & subpicture->sub_rect.x, (gint *) & subpicture->sub_rect.y,
       &subpicture->sub_rect.width, &subpicture->sub_rect.height);
 
-  if (!gst_mfx_surface_map (subpicture->surface))
+  if (!gst_mfx_surface_map (subpicture->surface, GST_MAP_WRITE))
     goto error;
-  if (subpicture->sub_rect.width == GST_MFX_SURFACE_WIDTH (subpicture->surface)
-      && subpicture->sub_rect.height ==
-      GST_MFX_SURFACE_HEIGHT (subpicture->surface)) {
-    memcpy (gst_mfx_surface_get_plane (subpicture->surface, 0), data,
-        map_info.size);
-  } else {
-    guint8 *plane = gst_mfx_surface_get_plane (subpicture->surface, 0);
-    guint i;
-
-    for (i = 0; i < subpicture->sub_rect.height; i++)
-      memcpy (plane + i * GST_MFX_SURFACE_WIDTH (subpicture->surface) * 4,
-          data + i * subpicture->sub_rect.width * 4,
-          subpicture->sub_rect.width * 4);
-  }
+  gst_mfx_copy_plane_memcpy (gst_mfx_surface_get_plane (subpicture->surface, 0),
+      gst_mfx_surface_get_pitch (subpicture->surface, 0), data, stride,
+      vmeta->width * 4, vmeta->height);
   gst_mfx_surface_unmap (subpicture->surface);
 
   gst_video_meta_unmap (vmeta, 0, &map_info);
@@ -32,6 +32,26 @@
 #define DEBUG 1
 #include "gstmfxdebug.h"
 
+/* Upper bound on the number of surfaces of a single pool */
+#define MAX_SURFACES            1024
+#define SLOTS_PER_CHUNK         64
+#define MAX_CHUNKS              (MAX_SURFACES / SLOTS_PER_CHUNK)
+
+typedef struct _GstMfxSurfacePoolSlot GstMfxSurfacePoolSlot;
+struct _GstMfxSurfacePoolSlot
+{
+  GstMfxSurface *surface;
+  volatile gint used;
+};
+
+/* Cell of the bounded MPMC ring holding free slot indices */
+typedef struct _GstMfxSurfacePoolCell GstMfxSurfacePoolCell;
+struct _GstMfxSurfacePoolCell
+{
+  volatile gint sequence;
+  guint index;
+};
+
 struct _GstMfxSurfacePool
 {
   /*< private > */
@@ -41,42 +61,150 @@ struct _GstMfxSurfacePool
   GstMfxTask *task;
   GstVideoInfo info;
   gboolean memtype_is_system;
-  GQueue free_surfaces;
-  GList *used_surfaces;
-  guint used_count;
+
+  /* Every surface owned by the pool lives in a slot. Slots are allocated
+   * in chunks that never move, so they can be read without locking once
+   * published through num_slots. Free slot indices are kept in a lock-free
+   * ring, and frame surfaces map back to their slot */
+  GstMfxSurfacePoolSlot *chunks[MAX_CHUNKS];
+  volatile gint num_slots;
+  volatile gint next_slot;
+
+  GstMfxSurfacePoolCell free_slots[MAX_SURFACES];
+  volatile gint free_head;
+  volatile gint free_tail;
+
+  /* Protects slot creation and slot_map */
+  GHashTable *slot_map;
   GMutex mutex;
 };
 
 G_DEFINE_TYPE (GstMfxSurfacePool, gst_mfx_surface_pool, GST_TYPE_OBJECT);
 
+#define SLOT(pool, i) \
+    (&(pool)->chunks[(i) / SLOTS_PER_CHUNK][(i) % SLOTS_PER_CHUNK])
+
 static void
-gst_mfx_surface_pool_put_surface (GstMfxSurfacePool * pool,
-    GstMfxSurface * surface);
+free_slots_push (GstMfxSurfacePool * pool, guint index)
+{
+  GstMfxSurfacePoolCell *cell;
+  gint pos, diff;
+
+  /* Never full since the ring can hold every slot of the pool */
+  pos = g_atomic_int_get (&pool->free_tail);
+  for (;;) {
+    cell = &pool->free_slots[(guint) pos % MAX_SURFACES];
+    diff = g_atomic_int_get (&cell->sequence) - pos;
+    if (diff == 0) {
+      if (g_atomic_int_compare_and_exchange (&pool->free_tail, pos, pos + 1))
+        break;
+    }
+    pos = g_atomic_int_get (&pool->free_tail);
+  }
+
+  cell->index = index;
+  g_atomic_int_set (&cell->sequence, pos + 1);
+}
+
+static gboolean
+free_slots_pop (GstMfxSurfacePool * pool, guint * index)
+{
+  GstMfxSurfacePoolCell *cell;
+  gint pos, diff;
+
+  pos = g_atomic_int_get (&pool->free_head);
+  for (;;) {
+    cell = &pool->free_slots[(guint) pos % MAX_SURFACES];
+    diff = g_atomic_int_get (&cell->sequence) - (pos + 1);
+    if (diff == 0) {
+      if (g_atomic_int_compare_and_exchange (&pool->free_head, pos, pos + 1))
+        break;
+    } else if (diff < 0)
+      return FALSE;
+    pos = g_atomic_int_get (&pool->free_head);
+  }
 
-static gint
-sync_output_surface (gconstpointer surface, gconstpointer surf)
+  *index = cell->index;
+  g_atomic_int_set (&cell->sequence, pos + MAX_SURFACES);
+  return TRUE;
+}
+
+/* Must be called with the pool mutex held */
+static gboolean
+gst_mfx_surface_pool_add_slot (GstMfxSurfacePool * pool,
+    GstMfxSurface * surface, guint * index_ptr)
 {
-  GstMfxSurface *_surface = (GstMfxSurface *) surface;
-  mfxFrameSurface1 *_surf = (mfxFrameSurface1 *) surf;
+  GstMfxSurfacePoolSlot *slot;
+  guint index = g_atomic_int_get (&pool->num_slots);
+
+  if (index >= MAX_SURFACES) {
+    GST_ERROR ("surface pool exceeded %d surfaces", MAX_SURFACES);
+    return FALSE;
+  }
 
-  return _surf != GST_MFX_SURFACE_FRAME_SURFACE (_surface);
+  if (!pool->chunks[index / SLOTS_PER_CHUNK])
+    pool->chunks[index / SLOTS_PER_CHUNK] =
+        g_new0 (GstMfxSurfacePoolSlot, SLOTS_PER_CHUNK);
+
+  slot = SLOT (pool, index);
+  slot->surface = surface;
+  slot->used = FALSE;
+  g_hash_table_insert (pool->slot_map,
+      gst_mfx_surface_get_frame_surface (surface), GUINT_TO_POINTER (index));
+
+  /* Publish the slot to lock-free readers */
+  g_atomic_int_set (&pool->num_slots, index + 1);
+  *index_ptr = index;
+  return TRUE;
 }
 
 static void
-release_surfaces (gpointer surface, gpointer pool)
+gst_mfx_surface_pool_put_slot (GstMfxSurfacePool * pool, guint index)
 {
-  GstMfxSurface *_surface = (GstMfxSurface *) surface;
-  GstMfxSurfacePool *_pool = (GstMfxSurfacePool *) pool;
+  GstMfxSurfacePoolSlot *const slot = SLOT (pool, index);
+
+  if (!g_atomic_int_compare_and_exchange (&slot->used, TRUE, FALSE))
+    return;
 
-  mfxFrameSurface1 *surf = gst_mfx_surface_get_frame_surface (_surface);
-  if (surf && !surf->Data.Locked)
-    gst_mfx_surface_pool_put_surface (_pool, _surface);
+  gst_mfx_surface_unref (slot->surface);
+  free_slots_push (pool, index);
+}
+
+/* Returns the next used surface no longer locked by MSDK to the free
+ * ring. The search resumes where the previous one stopped, and since
+ * surfaces are mostly released in the order they were handed out, it
+ * usually ends at the first slot checked */
+static gboolean
+gst_mfx_surface_pool_reclaim (GstMfxSurfacePool * pool)
+{
+  guint i, index, num_slots = g_atomic_int_get (&pool->num_slots);
+  guint next_slot = g_atomic_int_get (&pool->next_slot);
+
+  for (i = 0; i < num_slots; i++) {
+    GstMfxSurfacePoolSlot *slot;
+    mfxFrameSurface1 *surf;
+
+    index = (next_slot + i) % num_slots;
+    slot = SLOT (pool, index);
+    if (!g_atomic_int_get (&slot->used))
+      continue;
+
+    surf = gst_mfx_surface_get_frame_surface (slot->surface);
+    if (surf && !surf->Data.Locked
+        && g_atomic_int_compare_and_exchange (&slot->used, TRUE, FALSE)) {
+      gst_mfx_surface_unref (slot->surface);
+      free_slots_push (pool, index);
+      g_atomic_int_set (&pool->next_slot, index + 1);
+      return TRUE;
+    }
+  }
+  return FALSE;
 }
 
 static gboolean
 gst_mfx_surface_pool_add_surfaces (GstMfxSurfacePool * pool)
 {
-  guint i, num_surfaces = gst_mfx_task_get_num_surfaces (pool->task);
+  guint i, index, num_surfaces = gst_mfx_task_get_num_surfaces (pool->task);
   GstMfxSurface *surface = NULL;
 
   for (i = 0; i < num_surfaces; i++) {
@@ -93,7 +221,11 @@ gst_mfx_surface_pool_add_surfaces (GstMfxSurfacePool * pool)
     if (!surface)
       return FALSE;
 
-    g_queue_push_tail (&pool->free_surfaces, surface);
+    if (!gst_mfx_surface_pool_add_slot (pool, surface, &index)) {
+      gst_mfx_surface_unref (surface);
+      return FALSE;
+    }
+    free_slots_push (pool, index);
   }
   return TRUE;
 }
@@ -111,16 +243,16 @@ static void
 gst_mfx_surface_pool_finalize (GObject * object)
 {
   GstMfxSurfacePool *pool = GST_MFX_SURFACE_POOL (object);
-  GstMfxSurface *surface;
+  guint i;
 
-  while (g_list_length (pool->used_surfaces)) {
-    surface = g_list_nth_data (pool->used_surfaces, 0);
-    gst_mfx_surface_pool_put_surface (pool, surface);
+  for (i = 0; i < pool->num_slots; i++) {
+    gst_mfx_surface_pool_put_slot (pool, i);
+    gst_mfx_surface_unref (SLOT (pool, i)->surface);
   }
+  for (i = 0; i < MAX_CHUNKS; i++)
+    g_free (pool->chunks[i]);
 
-  g_list_free (pool->used_surfaces);
-  g_queue_foreach (&pool->free_surfaces, (GFunc) gst_mfx_surface_unref, NULL);
-  g_queue_clear (&pool->free_surfaces);
+  g_hash_table_unref (pool->slot_map);
   g_mutex_clear (&pool->mutex);
 
   gst_mfx_task_replace (&pool->task, NULL);
@@ -198,102 +330,106 @@ gst_mfx_surface_pool_replace (GstMfxSurfacePool ** old_pool_ptr,
   gst_object_replace ((GstObject **) old_pool_ptr, GST_OBJECT (new_pool));
 }
 
-
-static void
-gst_mfx_surface_pool_put_surface_unlocked (GstMfxSurfacePool * pool,
-    GstMfxSurface * surface)
+static GstMfxSurface *
+gst_mfx_surface_pool_new_surface (GstMfxSurfacePool * pool)
 {
-  GList *elem;
+  GstMfxSurface *surface;
 
-  elem = g_list_find (pool->used_surfaces, surface);
-  if (!elem)
-    return;
+  if (pool->task)
+    return gst_mfx_surface_new_from_task (pool->task);
 
-  gst_mfx_surface_unref (surface);
-  --pool->used_count;
-  pool->used_surfaces = g_list_delete_link (pool->used_surfaces, elem);
-  g_queue_push_tail (&pool->free_surfaces, surface);
+  if (!pool->memtype_is_system)
+#ifdef WITH_LIBVA_BACKEND
+    surface = gst_mfx_surface_vaapi_new (pool->context, &pool->info);
+#else
+    surface = gst_mfx_surface_d3d11_new (pool->context, &pool->info);
+#endif
+  else
+    surface = gst_mfx_surface_new (&pool->info);
+  return surface;
 }
 
-static void
-gst_mfx_surface_pool_put_surface (GstMfxSurfacePool * pool,
-    GstMfxSurface * surface)
+GstMfxSurface *
+gst_mfx_surface_pool_get_surface (GstMfxSurfacePool * pool)
 {
-  g_return_if_fail (pool != NULL);
-  g_return_if_fail (surface != NULL);
+  GstMfxSurface *surface;
+  gboolean added;
+  guint index;
 
-  g_mutex_lock (&pool->mutex);
-  gst_mfx_surface_pool_put_surface_unlocked (pool, surface);
-  g_mutex_unlock (&pool->mutex);
-}
+  g_return_val_if_fail (pool != NULL, NULL);
 
-static GstMfxSurface *
-gst_mfx_surface_pool_get_surface_unlocked (GstMfxSurfacePool * pool)
-{
-  GstMfxSurface *surface;
+  /* Fast path, no lock taken */
+  while (!free_slots_pop (pool, &index)) {
+    if (gst_mfx_surface_pool_reclaim (pool))
+      continue;
 
-  surface = g_queue_pop_head (&pool->free_surfaces);
-  if (!surface) {
-    g_mutex_unlock (&pool->mutex);
-    if (pool->task) {
-      surface = gst_mfx_surface_new_from_task (pool->task);
-    } else {
-      if (!pool->memtype_is_system)
-#ifdef WITH_LIBVA_BACKEND
-        surface = gst_mfx_surface_vaapi_new (pool->context, &pool->info);
-#else
-        surface = gst_mfx_surface_d3d11_new (pool->context, &pool->info);
-#endif
-      else
-        surface = gst_mfx_surface_new (&pool->info);
-    }
+    surface = gst_mfx_surface_pool_new_surface (pool);
+    if (!surface)
+      return NULL;
 
     g_mutex_lock (&pool->mutex);
-    if (!surface)
+    added = gst_mfx_surface_pool_add_slot (pool, surface, &index);
+    g_mutex_unlock (&pool->mutex);
+    if (!added) {
+      gst_mfx_surface_unref (surface);
       return NULL;
+    }
+    break;
   }
 
-  ++pool->used_count;
-  pool->used_surfaces = g_list_prepend (pool->used_surfaces, surface);
-
-  return gst_mfx_surface_ref (surface);
+  /* Take the caller reference before the slot becomes reclaimable */
+  surface = gst_mfx_surface_ref (SLOT (pool, index)->surface);
+  /* A recycled surface may still be written by an operation nobody
+   * waited on, which has to finish before it gets reused */
+  gst_mfx_surface_sync (surface);
+  gst_mfx_surface_invalidate (surface);
+  g_atomic_int_set (&SLOT (pool, index)->used, TRUE);
+  return surface;
 }
 
 GstMfxSurface *
-gst_mfx_surface_pool_get_surface (GstMfxSurfacePool * pool)
+gst_mfx_surface_pool_find_surface (GstMfxSurfacePool * pool,
+    mfxFrameSurface1 * surface)
 {
-  GstMfxSurface *surface;
+  GstMfxSurface *found = NULL;
+  gpointer index;
 
   g_return_val_if_fail (pool != NULL, NULL);
 
-  g_list_foreach (pool->used_surfaces, release_surfaces, pool);
-
   g_mutex_lock (&pool->mutex);
-  surface = gst_mfx_surface_pool_get_surface_unlocked (pool);
+  if (g_hash_table_lookup_extended (pool->slot_map, surface, NULL, &index))
+    found = SLOT (pool, GPOINTER_TO_UINT (index))->surface;
   g_mutex_unlock (&pool->mutex);
 
-  return surface;
+  return found;
 }
 
-GstMfxSurface *
-gst_mfx_surface_pool_find_surface (GstMfxSurfacePool * pool,
-    mfxFrameSurface1 * surface)
+/* Forgets the pending syncpoints of every surface of the pool, handed out
+ * or not. Only valid once the operations behind them have completed, for
+ * when their session is about to be reset or closed */
+void
+gst_mfx_surface_pool_clear_sync_points (GstMfxSurfacePool * pool)
 {
-  g_return_val_if_fail (pool != NULL, NULL);
+  guint i, num_slots;
 
-  GList *l = g_list_find_custom (pool->used_surfaces, surface,
-      sync_output_surface);
+  g_return_if_fail (pool != NULL);
 
-  return GST_MFX_SURFACE (l->data);
+  num_slots = g_atomic_int_get (&pool->num_slots);
+  for (i = 0; i < num_slots; i++)
+    gst_mfx_surface_set_sync_point (SLOT (pool, i)->surface, NULL, NULL);
 }
 
 static void
 gst_mfx_surface_pool_init (GstMfxSurfacePool * pool)
 {
-  pool->used_surfaces = NULL;
-  pool->used_count = 0;
+  guint i;
+
+  for (i = 0; i < MAX_SURFACES; i++)
+    pool->free_slots[i].sequence = i;
+  pool->free_head = pool->free_tail = 0;
+  pool->num_slots = pool->next_slot = 0;
 
-  g_queue_init (&pool->free_surfaces);
+  pool->slot_map = g_hash_table_new (g_direct_hash, g_direct_equal);
   g_mutex_init (&pool->mutex);
 }
 
@@ -54,5 +54,8 @@ GstMfxSurface *
 gst_mfx_surface_pool_find_surface (GstMfxSurfacePool * pool,
     mfxFrameSurface1 * surface);
 
+void
+gst_mfx_surface_pool_clear_sync_points (GstMfxSurfacePool * pool);
+
 G_END_DECLS
 #endif /* GST_MFX_SURFACE_POOL_H */
@@ -138,6 +138,8 @@ gst_mfx_task_use_video_memory (GstMfxTask * task)
   };
 
   MFXVideoCORE_SetFrameAllocator (priv->session, &frame_allocator);
+  gst_mfx_task_aggregator_mark_frame_allocator (priv->aggregator,
+      priv->session);
   priv->memtype_is_system = FALSE;
 }
 
@@ -184,7 +186,7 @@ gst_mfx_task_finalize (GObject * object)
 
   if (priv->is_joined) {
     MFXDisjoinSession (priv->session);
-    MFXClose (priv->session);
+    gst_mfx_task_aggregator_release_session (priv->aggregator, priv->session);
   }
   gst_mfx_task_aggregator_remove_task (priv->aggregator, task);
   gst_mfx_task_aggregator_unref (priv->aggregator);
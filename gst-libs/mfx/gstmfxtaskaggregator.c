@@ -21,9 +21,47 @@
 #include "gstmfxtaskaggregator.h"
 #include "gstmfxcontext.h"
 
+#include <stdlib.h>
+
 #define DEBUG 1
 #include "gstmfxdebug.h"
 
+/* Device busy backoff bounds */
+#define DEVICE_BUSY_MIN_DELAY_US 50
+#define DEVICE_BUSY_MAX_DELAY_US 4000
+
+/* Sessions released by tasks that an aggregator keeps for reuse */
+#define SESSION_POOL_MAX_IDLE 4
+
+/* Process-wide pool of initialized sessions that have no device handle
+ * yet, so that any aggregator can bind one to its own display */
+typedef struct _GstMfxSessionPool GstMfxSessionPool;
+struct _GstMfxSessionPool
+{
+  GMutex lock;
+  GQueue idle;
+  mfxVersion version;
+  guint min_idle;
+  GThreadPool *refill_pool;
+  gboolean refilling;
+  guint64 hits;
+  guint64 misses;
+};
+
+static GstMfxSessionPool session_pool = {
+  .idle = G_QUEUE_INIT,
+};
+
+/* Operation waited on by the completion thread */
+typedef struct _GstMfxCompletionJob GstMfxCompletionJob;
+struct _GstMfxCompletionJob
+{
+  mfxSession session;
+  mfxSyncPoint syncp;
+  GstMfxTaskAggregatorCompletionFunc func;
+  gpointer user_data;
+};
+
 /**
 * GstMfxTaskAggregator:
 *
@@ -38,19 +76,225 @@ struct _GstMfxTaskAggregator
   GList *tasks;
   GstMfxTask *current_task;
   mfxSession parent_session;
+  /* Protected by the object lock */
+  GList *allocator_sessions;
+  GQueue idle_sessions;
   mfxVersion version;
   mfxU16 platform;
+
+  /* Completion thread, started on first submission */
+  GThread *completion_thread;
+  GAsyncQueue *completion_queue;
+  GMutex completion_lock;
+  GCond completion_cond;
+  guint completion_seq;
+  guint pending_completions;
 };
 
 G_DEFINE_TYPE (GstMfxTaskAggregator, gst_mfx_task_aggregator, GST_TYPE_OBJECT);
 
+static mfxSession
+session_open (mfxVersion * version)
+{
+  mfxIMPL impl;
+  mfxStatus sts;
+  mfxSession session = NULL;
+  const char *desc;
+
+  impl = MFX_IMPL_HARDWARE_ANY;
+#if WITH_D3D11_BACKEND
+  impl |= MFX_IMPL_VIA_D3D11;
+#endif
+
+  sts = MFXInit (impl, version, &session);
+  if (sts < 0) {
+    GST_ERROR ("Error initializing internal MFX session");
+    return NULL;
+  }
+
+  MFXQueryVersion (session, version);
+  MFXQueryIMPL (session, &impl);
+
+  switch (MFX_IMPL_BASETYPE (impl)) {
+    case MFX_IMPL_SOFTWARE:
+      desc = "software";
+      break;
+    case MFX_IMPL_HARDWARE:
+    case MFX_IMPL_HARDWARE2:
+    case MFX_IMPL_HARDWARE3:
+    case MFX_IMPL_HARDWARE4:
+      desc = "hardware accelerated";
+      break;
+    default:
+      desc = "unknown";
+  }
+
+  GST_INFO ("Initialized internal MFX session using %s implementation", desc);
+  return session;
+}
+
+static mfxSession
+session_pool_open (void)
+{
+  mfxVersion version = {
+    {GST_MFX_MIN_MSDK_VERSION_MINOR, GST_MFX_MIN_MSDK_VERSION_MAJOR}
+  };
+  mfxSession session;
+
+  session = session_open (&version);
+  if (!session)
+    return NULL;
+
+  g_mutex_lock (&session_pool.lock);
+  session_pool.version = version;
+  g_mutex_unlock (&session_pool.lock);
+  return session;
+}
+
+static void
+session_pool_refill (gpointer data, gpointer user_data)
+{
+  mfxSession session;
+
+  g_mutex_lock (&session_pool.lock);
+  while (session_pool.idle.length < session_pool.min_idle) {
+    g_mutex_unlock (&session_pool.lock);
+    session = session_pool_open ();
+    g_mutex_lock (&session_pool.lock);
+    if (!session)
+      break;
+    g_queue_push_tail (&session_pool.idle, session);
+  }
+  session_pool.refilling = FALSE;
+  g_mutex_unlock (&session_pool.lock);
+}
+
+/* Called with the pool lock held */
+static void
+session_pool_schedule_refill (void)
+{
+  if (session_pool.refilling
+      || session_pool.idle.length >= session_pool.min_idle)
+    return;
+
+  if (!session_pool.refill_pool)
+    session_pool.refill_pool =
+        g_thread_pool_new (session_pool_refill, NULL, 1, FALSE, NULL);
+  if (session_pool.refill_pool) {
+    session_pool.refilling = TRUE;
+    g_thread_pool_push (session_pool.refill_pool, &session_pool, NULL);
+  }
+}
+
+static gpointer
+session_pool_init (gpointer data)
+{
+  const gchar *min_idle = g_getenv ("GST_MFX_SESSION_POOL_MIN_IDLE");
+
+  if (min_idle)
+    session_pool.min_idle = MIN (strtoul (min_idle, NULL, 10), 64);
+  return NULL;
+}
+
+static void
+session_pool_ensure_init (void)
+{
+  static GOnce once = G_ONCE_INIT;
+
+  g_once (&once, session_pool_init, NULL);
+}
+
+/* Prefers a session released earlier by a task of @aggregator, which is
+ * already bound to its display, over a fresh one from the process pool */
+static mfxSession
+session_pool_acquire (GstMfxTaskAggregator * aggregator)
+{
+  mfxSession session;
+  gboolean reused;
+
+  session_pool_ensure_init ();
+
+  GST_OBJECT_LOCK (aggregator);
+  session = g_queue_pop_head (&aggregator->idle_sessions);
+  GST_OBJECT_UNLOCK (aggregator);
+  reused = session != NULL;
+
+  g_mutex_lock (&session_pool.lock);
+  if (!session)
+    session = g_queue_pop_head (&session_pool.idle);
+  if (session)
+    session_pool.hits++;
+  else
+    session_pool.misses++;
+  GST_DEBUG ("Session pool %s, %" G_GUINT64_FORMAT " hits, %"
+      G_GUINT64_FORMAT " misses", session ? (reused ? "hit (same display)" :
+          "hit") : "miss", session_pool.hits, session_pool.misses);
+  session_pool_schedule_refill ();
+  g_mutex_unlock (&session_pool.lock);
+
+  if (!session)
+    session = session_pool_open ();
+  if (!session)
+    return NULL;
+
+  g_mutex_lock (&session_pool.lock);
+  aggregator->version = session_pool.version;
+  g_mutex_unlock (&session_pool.lock);
+  return session;
+}
+
+/* Sets how many initialized sessions the pool keeps ready for new tasks.
+ * Defaults to the GST_MFX_SESSION_POOL_MIN_IDLE environment variable,
+ * or 0, in which case only sessions released by earlier tasks of the
+ * same aggregator get reused */
+void
+gst_mfx_task_aggregator_set_session_pool_min_idle (guint min_idle)
+{
+  session_pool_ensure_init ();
+
+  g_mutex_lock (&session_pool.lock);
+  session_pool.min_idle = min_idle;
+  session_pool_schedule_refill ();
+  g_mutex_unlock (&session_pool.lock);
+}
+
+/* Counts the sessions served from the pool and those that had to be
+ * initialized on demand */
+void
+gst_mfx_task_aggregator_get_session_pool_stats (guint64 * hits,
+    guint64 * misses)
+{
+  g_mutex_lock (&session_pool.lock);
+  if (hits)
+    *hits = session_pool.hits;
+  if (misses)
+    *misses = session_pool.misses;
+  g_mutex_unlock (&session_pool.lock);
+}
+
 static void
 gst_mfx_task_aggregator_finalize (GObject * object)
 {
   GstMfxTaskAggregator *aggregator = GST_MFX_TASK_AGGREGATOR (object);
 
-  MFXClose (aggregator->parent_session);
+  if (aggregator->completion_thread) {
+    /* An empty job tells the thread to exit */
+    g_async_queue_push (aggregator->completion_queue,
+        g_slice_new0 (GstMfxCompletionJob));
+    g_thread_join (aggregator->completion_thread);
+  }
+  g_async_queue_unref (aggregator->completion_queue);
+  g_mutex_clear (&aggregator->completion_lock);
+  g_cond_clear (&aggregator->completion_cond);
+
+  /* Joined sessions were all released along with their tasks, and are
+   * bound to the display going away with this aggregator */
+  g_queue_foreach (&aggregator->idle_sessions, (GFunc) MFXClose, NULL);
+  g_queue_clear (&aggregator->idle_sessions);
+  if (aggregator->parent_session)
+    MFXClose (aggregator->parent_session);
   gst_mfx_context_replace (&aggregator->context, NULL);
+  g_list_free (aggregator->allocator_sessions);
   g_list_free (aggregator->tasks);
 
   G_OBJECT_CLASS (gst_mfx_task_aggregator_parent_class)->finalize (object);
@@ -63,6 +307,12 @@ gst_mfx_task_aggregator_init (GstMfxTaskAggregator * aggregator)
   aggregator->context = NULL;
   aggregator->version.Major = GST_MFX_MIN_MSDK_VERSION_MAJOR;
   aggregator->version.Minor = GST_MFX_MIN_MSDK_VERSION_MINOR;
+
+  g_queue_init (&aggregator->idle_sessions);
+
+  aggregator->completion_queue = g_async_queue_new ();
+  g_mutex_init (&aggregator->completion_lock);
+  g_cond_init (&aggregator->completion_cond);
 }
 
 GstMfxTaskAggregator *
@@ -107,50 +357,20 @@ mfxSession
 gst_mfx_task_aggregator_init_session_context (GstMfxTaskAggregator * aggregator,
     gboolean * is_joined)
 {
-  mfxIMPL impl;
-  mfxStatus sts;
-  mfxSession session = NULL;
-  const char *desc;
+  mfxSession session;
 
-  impl = MFX_IMPL_HARDWARE_ANY;
-#if WITH_D3D11_BACKEND
-  impl |= MFX_IMPL_VIA_D3D11;
-#endif
-
-  sts = MFXInit (impl, &aggregator->version, &session);
-  if (sts < 0) {
-    GST_ERROR ("Error initializing internal MFX session");
+  session = session_pool_acquire (aggregator);
+  if (!session)
     return NULL;
-  }
-
-  MFXQueryVersion (session, &aggregator->version);
 
   GST_INFO ("Using Media SDK API version %d.%d",
       aggregator->version.Major, aggregator->version.Minor);
 
-  MFXQueryIMPL (session, &impl);
-
-  switch (MFX_IMPL_BASETYPE (impl)) {
-    case MFX_IMPL_SOFTWARE:
-      desc = "software";
-      break;
-    case MFX_IMPL_HARDWARE:
-    case MFX_IMPL_HARDWARE2:
-    case MFX_IMPL_HARDWARE3:
-    case MFX_IMPL_HARDWARE4:
-      desc = "hardware accelerated";
-      break;
-    default:
-      desc = "unknown";
-  }
-
-  GST_INFO ("Initialized internal MFX session using %s implementation", desc);
-
   if (!aggregator->parent_session) {
     aggregator->parent_session = session;
     *is_joined = FALSE;
   } else {
-    sts = MFXJoinSession (aggregator->parent_session, session);
+    MFXJoinSession (aggregator->parent_session, session);
     *is_joined = TRUE;
   }
 
@@ -160,6 +380,47 @@ gst_mfx_task_aggregator_init_session_context (GstMfxTaskAggregator * aggregator,
   return session;
 }
 
+/* Takes back a disjoined task session for later tasks of @aggregator.
+ * Sessions that got an external frame allocator are closed, as MFX
+ * cannot unset it */
+void
+gst_mfx_task_aggregator_release_session (GstMfxTaskAggregator * aggregator,
+    mfxSession session)
+{
+  GList *elem;
+
+  g_return_if_fail (aggregator != NULL);
+  g_return_if_fail (session != NULL);
+
+  GST_OBJECT_LOCK (aggregator);
+  elem = g_list_find (aggregator->allocator_sessions, session);
+  if (elem)
+    aggregator->allocator_sessions =
+        g_list_delete_link (aggregator->allocator_sessions, elem);
+  else if (aggregator->idle_sessions.length < SESSION_POOL_MAX_IDLE) {
+    g_queue_push_tail (&aggregator->idle_sessions, session);
+    session = NULL;
+  }
+  GST_OBJECT_UNLOCK (aggregator);
+
+  if (session)
+    MFXClose (session);
+}
+
+/* Records that @session got an external frame allocator */
+void
+gst_mfx_task_aggregator_mark_frame_allocator (GstMfxTaskAggregator *
+    aggregator, mfxSession session)
+{
+  g_return_if_fail (aggregator != NULL);
+
+  GST_OBJECT_LOCK (aggregator);
+  if (!g_list_find (aggregator->allocator_sessions, session))
+    aggregator->allocator_sessions =
+        g_list_prepend (aggregator->allocator_sessions, session);
+  GST_OBJECT_UNLOCK (aggregator);
+}
+
 GstMfxTask *
 gst_mfx_task_aggregator_get_current_task (GstMfxTaskAggregator * aggregator)
 {
@@ -213,6 +474,136 @@ gst_mfx_task_aggregator_remove_task (GstMfxTaskAggregator * aggregator,
   aggregator->tasks = g_list_delete_link (aggregator->tasks, elem);
 }
 
+static gpointer
+completion_thread_func (gpointer data)
+{
+  GstMfxTaskAggregator *const aggregator = data;
+  GstMfxCompletionJob *job;
+  mfxStatus sts;
+
+  while (!!(job = g_async_queue_pop (aggregator->completion_queue))) {
+    if (!job->syncp) {
+      g_slice_free (GstMfxCompletionJob, job);
+      break;
+    }
+
+    do {
+      sts = MFXVideoCORE_SyncOperation (job->session, job->syncp, 1000);
+    } while (MFX_WRN_IN_EXECUTION == sts);
+
+    if (MFX_ERR_NONE != sts && sts < 0)
+      GST_ERROR ("MFXVideoCORE_SyncOperation() error status: %d", sts);
+
+    if (job->func)
+      job->func (sts, job->user_data);
+    g_slice_free (GstMfxCompletionJob, job);
+
+    g_mutex_lock (&aggregator->completion_lock);
+    aggregator->completion_seq++;
+    aggregator->pending_completions--;
+    g_cond_broadcast (&aggregator->completion_cond);
+    g_mutex_unlock (&aggregator->completion_lock);
+  }
+  return NULL;
+}
+
+/* Hands @syncp over to the completion thread, which calls @func with the
+ * final status once the operation is done. The caller has to keep @session
+ * open and @user_data alive until then. Jobs complete in submission order */
+void
+gst_mfx_task_aggregator_submit (GstMfxTaskAggregator * aggregator,
+    mfxSession session, mfxSyncPoint syncp,
+    GstMfxTaskAggregatorCompletionFunc func, gpointer user_data)
+{
+  GstMfxCompletionJob *job;
+
+  g_return_if_fail (aggregator != NULL);
+  g_return_if_fail (syncp != NULL);
+
+  job = g_slice_new (GstMfxCompletionJob);
+  job->session = session;
+  job->syncp = syncp;
+  job->func = func;
+  job->user_data = user_data;
+
+  g_mutex_lock (&aggregator->completion_lock);
+  if (!aggregator->completion_thread)
+    aggregator->completion_thread = g_thread_new ("mfxcompletion",
+        completion_thread_func, aggregator);
+  aggregator->pending_completions++;
+  g_mutex_unlock (&aggregator->completion_lock);
+
+  g_async_queue_push (aggregator->completion_queue, job);
+}
+
+/* Blocks until the next submitted operation completes or @timeout_us
+ * elapses. Meant for MFX_WRN_DEVICE_BUSY retries: finished work is what
+ * frees the device up, so retrying right then avoids blind sleeps. With
+ * nothing submitted, this just sleeps for @timeout_us */
+void
+gst_mfx_task_aggregator_wait_completion (GstMfxTaskAggregator * aggregator,
+    gint64 timeout_us)
+{
+  gint64 end_time;
+  guint seq;
+
+  g_return_if_fail (aggregator != NULL);
+
+  g_mutex_lock (&aggregator->completion_lock);
+  if (!aggregator->pending_completions) {
+    g_mutex_unlock (&aggregator->completion_lock);
+    g_usleep (timeout_us);
+    return;
+  }
+
+  end_time = g_get_monotonic_time () + timeout_us;
+  seq = aggregator->completion_seq;
+  while (seq == aggregator->completion_seq)
+    if (!g_cond_wait_until (&aggregator->completion_cond,
+            &aggregator->completion_lock, end_time))
+      break;
+  g_mutex_unlock (&aggregator->completion_lock);
+}
+
+/* Called on MFX_WRN_DEVICE_BUSY before resubmitting. The first retry of
+ * a busy spell waits for the caller's oldest operation, since that is the
+ * work most likely to free the device up, and retries right away. Further
+ * retries back off exponentially, still waking up on any completion */
+void
+gst_mfx_task_aggregator_wait_device_busy (GstMfxTaskAggregator * aggregator,
+    GstMfxDeviceBusy * busy, GstMfxSyncOldestFunc sync_oldest,
+    gpointer user_data)
+{
+  gint64 start;
+
+  g_return_if_fail (aggregator != NULL);
+  g_return_if_fail (busy != NULL);
+
+  start = g_get_monotonic_time ();
+  busy->retries++;
+
+  if (!busy->delay_us) {
+    busy->delay_us = DEVICE_BUSY_MIN_DELAY_US;
+    if (sync_oldest && sync_oldest (user_data))
+      goto done;
+  }
+
+  gst_mfx_task_aggregator_wait_completion (aggregator, busy->delay_us);
+  busy->delay_us = MIN (busy->delay_us * 2, DEVICE_BUSY_MAX_DELAY_US);
+
+done:
+  busy->busy_time_us += g_get_monotonic_time () - start;
+}
+
+/* Ends a busy spell once the device accepted the work */
+void
+gst_mfx_device_busy_reset (GstMfxDeviceBusy * busy)
+{
+  g_return_if_fail (busy != NULL);
+
+  busy->delay_us = 0;
+}
+
 #if MSDK_CHECK_VERSION(1,19)
 mfxU16
 gst_mfx_task_aggregator_get_platform (GstMfxTaskAggregator * aggregator)
@@ -32,6 +32,23 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (GstMfxTaskAggregator, gst_mfx_task_aggregator, GST_MFX,
     TASK_AGGREGATOR, GstObject)
 
+/* MFX_WRN_DEVICE_BUSY retry state, kept by each component submitting
+ * work. The counters accumulate over the component lifetime */
+typedef struct _GstMfxDeviceBusy GstMfxDeviceBusy;
+struct _GstMfxDeviceBusy
+{
+  guint delay_us;
+  guint64 retries;
+  guint64 busy_time_us;
+};
+
+/* Waits for the oldest operation in flight, if any, returning FALSE
+ * when there was nothing to wait for */
+typedef gboolean (*GstMfxSyncOldestFunc) (gpointer user_data);
+
+typedef void (*GstMfxTaskAggregatorCompletionFunc) (mfxStatus status,
+    gpointer user_data);
+
 GstMfxTaskAggregator *
 gst_mfx_task_aggregator_new (void);
 
@@ -66,10 +83,42 @@ mfxSession
 gst_mfx_task_aggregator_init_session_context (GstMfxTaskAggregator * aggregator,
     gboolean * is_joined);
 
+void
+gst_mfx_task_aggregator_release_session (GstMfxTaskAggregator * aggregator,
+    mfxSession session);
+
+void
+gst_mfx_task_aggregator_mark_frame_allocator (GstMfxTaskAggregator *
+    aggregator, mfxSession session);
+
+void
+gst_mfx_task_aggregator_set_session_pool_min_idle (guint min_idle);
+
+void
+gst_mfx_task_aggregator_get_session_pool_stats (guint64 * hits,
+    guint64 * misses);
+
 void
 gst_mfx_task_aggregator_remove_task (GstMfxTaskAggregator * aggregator,
     GstMfxTask * task);
 
+void
+gst_mfx_task_aggregator_submit (GstMfxTaskAggregator * aggregator,
+    mfxSession session, mfxSyncPoint syncp,
+    GstMfxTaskAggregatorCompletionFunc func, gpointer user_data);
+
+void
+gst_mfx_task_aggregator_wait_completion (GstMfxTaskAggregator * aggregator,
+    gint64 timeout_us);
+
+void
+gst_mfx_task_aggregator_wait_device_busy (GstMfxTaskAggregator * aggregator,
+    GstMfxDeviceBusy * busy, GstMfxSyncOldestFunc sync_oldest,
+    gpointer user_data);
+
+void
+gst_mfx_device_busy_reset (GstMfxDeviceBusy * busy);
+
 #if MSDK_CHECK_VERSION(1,19)
 mfxU16
 gst_mfx_task_aggregator_get_platform (GstMfxTaskAggregator * aggregator);
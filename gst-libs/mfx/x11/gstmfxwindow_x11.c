@@ -420,12 +420,10 @@ gst_mfx_window_x11_render (GstMfxWindow * window,
               &info);
     }
 
-    if (!gst_mfx_surface_map (priv->mapped_surface))
+    if (!gst_mfx_surface_map (priv->mapped_surface, GST_MAP_WRITE))
       return FALSE;
 
-    memcpy (gst_mfx_surface_get_plane (priv->mapped_surface, 0),
-        gst_mfx_surface_get_plane (surface, 0),
-        gst_mfx_surface_get_data_size (surface));
+    gst_mfx_surface_copy_data (priv->mapped_surface, surface);
 
     gst_mfx_surface_unmap (priv->mapped_surface);
   }
@@ -50,6 +50,74 @@
 #define DEBUG 1
 #include "gstmfxdebug.h"
 
+#ifdef WITH_LIBVA_BACKEND
+/* Makes the registry rescan the plugin, which drops the cached platform
+ * probe, whenever libmfx, its plugins or the VA driver change */
+static void
+plugin_add_dependencies (GstPlugin * plugin)
+{
+  static const gchar *driver_env[] = {
+    "LIBVA_DRIVER_NAME", "LIBVA_DRIVERS_PATH", NULL
+  };
+  static const gchar *driver_paths[] = {
+    "/usr/lib/dri", "/usr/lib64/dri", "/usr/lib/x86_64-linux-gnu/dri",
+    "/usr/local/lib/dri", "/opt/intel/mediasdk/lib64", NULL
+  };
+  static const gchar *driver_names[] = { "_drv_video.so", NULL };
+  static const gchar *mfx_env[] = {
+    "LD_LIBRARY_PATH", "MFX_HOME/lib/lin_x64", "INTELMEDIASDKROOT/lib/lin_x64",
+    NULL
+  };
+  static const gchar *mfx_paths[] = {
+    "/usr/lib", "/usr/lib64", "/usr/lib/x86_64-linux-gnu", "/usr/local/lib",
+    "/opt/intel/mediasdk/lib64", "/opt/intel/mediasdk/plugins", NULL
+  };
+  static const gchar *mfx_names[] = { "libmfx", NULL };
+
+  gst_plugin_add_dependency (plugin, driver_env, driver_paths, driver_names,
+      GST_PLUGIN_DEPENDENCY_FLAG_FILE_NAME_IS_SUFFIX);
+  gst_plugin_add_dependency (plugin, mfx_env, mfx_paths, mfx_names,
+      GST_PLUGIN_DEPENDENCY_FLAG_FILE_NAME_IS_PREFIX);
+}
+#endif // WITH_LIBVA_BACKEND
+
+/* Probing the platform initializes an MFX session on the GPU, so the
+ * result is kept in the registry cache and only probed again once the
+ * plugin gets rescanned */
+static gboolean
+plugin_probe_platform (GstPlugin * plugin, mfxU16 * platform)
+{
+  gboolean supported;
+#ifdef WITH_LIBVA_BACKEND
+  const GstStructure *cache;
+  guint code;
+
+  plugin_add_dependencies (plugin);
+
+  cache = gst_plugin_get_cache_data (plugin);
+  if (cache && gst_structure_get (cache,
+          "supported", G_TYPE_BOOLEAN, &supported,
+          "platform", G_TYPE_UINT, &code, NULL) && supported) {
+    GST_DEBUG ("Using cached MFX platform probe, device code %u", code);
+    *platform = code;
+    return supported;
+  }
+#endif // WITH_LIBVA_BACKEND
+
+  supported = gst_mfx_is_mfx_supported (platform);
+
+#ifdef WITH_LIBVA_BACKEND
+  /* A failed probe is not cached: missing GPU access (permissions, a
+   * container, a driver installed later) changes no file the registry
+   * watches, and must not keep the plugin empty until one does */
+  if (supported)
+    gst_plugin_set_cache_data (plugin, gst_structure_new ("mfx-probe",
+            "supported", G_TYPE_BOOLEAN, supported,
+            "platform", G_TYPE_UINT, (guint) * platform, NULL));
+#endif // WITH_LIBVA_BACKEND
+  return supported;
+}
+
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
@@ -58,7 +126,7 @@ plugin_init (GstPlugin * plugin)
 
   GST_DEBUG_CATEGORY_INIT (GST_CAT_DEFAULT, "mfx", 0, "MFX Plugins loader");
 
-  if (!gst_mfx_is_mfx_supported (&platform)) {
+  if (!plugin_probe_platform (plugin, &platform)) {
     GST_DEBUG ("No Intel MFX platform detected - skipping registration");
     return TRUE;
   }
@@ -47,11 +47,11 @@ static const char gst_mfxdecode_sink_caps_str[] =
     GST_CAPS_CODEC ("video/x-h264, \
         alignment = (string) au, \
         profile = (string) { constrained-baseline, baseline, main, high }, \
-        stream-format = (string) byte-stream")
+        stream-format = (string) { byte-stream, avc, avc3 }")
     GST_CAPS_CODEC ("video/x-h265, \
         alignment = (string) au, \
         profile = (string) { main, main-10 }, \
-        stream-format = (string) byte-stream")
+        stream-format = (string) { byte-stream, hvc1, hev1 }")
     GST_CAPS_CODEC ("video/mpeg, \
         mpegversion = 2")
     GST_CAPS_CODEC ("video/x-wmv, \
@@ -85,7 +85,9 @@ enum
   PROP_0,
   PROP_ASYNC_DEPTH,
   PROP_LIVE_MODE,
-  PROP_SKIP_CORRUPTED_FRAMES
+  PROP_SKIP_CORRUPTED_FRAMES,
+  PROP_DEVICE_BUSY_RETRIES,
+  PROP_DEVICE_BUSY_TIME
 };
 
 static GstStaticPadTemplate src_template_factory =
@@ -107,7 +109,7 @@ static GstMfxCodecMap mfx_codec_map[] = {
       "video/x-h264, \
       alignment = (string) au, \
       profile = (string) { constrained-baseline, baseline, main, high }, \
-      stream-format = (string) byte-stream"},
+      stream-format = (string) { byte-stream, avc, avc3 }"},
     {"hevc", GST_RANK_NONE, NULL},   // Determine caps later based on platform support
     {"mpeg2", GST_RANK_PRIMARY + 3,
       "video/mpeg, \
@@ -280,6 +282,52 @@ gst_mfxdec_negotiate (GstMfxDec * mfxdec)
   return TRUE;
 }
 
+/* Settles output caps once the decoder parsed the stream headers */
+static gboolean
+gst_mfxdec_negotiate_configured (GstMfxDec * mfxdec)
+{
+  if (!gst_mfxdec_negotiate (mfxdec))
+    return FALSE;
+  /* Final check to determine if system or video memory should be used for
+   * the output of the decoder */
+  gst_mfx_decoder_set_output_memtype (mfxdec->decoder,
+      GST_MFX_PLUGIN_BASE (mfxdec)->srcpad_caps_is_raw);
+  return TRUE;
+}
+
+/* Configures the decoder from codec_data as soon as caps are known, so
+ * that header parsing, negotiation and, when no peer MFX element may
+ * still join the decode task, session and surface setup overlap with
+ * upstream prerolling rather than delay the first frame */
+static void
+gst_mfxdec_configure_early (GstMfxDec * mfxdec)
+{
+  GstVideoDecoder *const vdec = GST_VIDEO_DECODER (mfxdec);
+
+  mfxdec->configured_early = FALSE;
+
+  /* Negotiation needs the downstream peer */
+  if (!gst_pad_is_linked (GST_VIDEO_DECODER_SRC_PAD (vdec)))
+    return;
+
+  if (GST_MFX_DECODER_STATUS_CONFIGURED !=
+      gst_mfx_decoder_prepare_from_codec_data (mfxdec->decoder))
+    return;
+
+  GST_DEBUG_OBJECT (mfxdec, "Configured decoder from codec_data");
+
+  /* The first frame finds the decoder already configured and relies on
+   * this to have negotiated */
+  mfxdec->configured_early = TRUE;
+  if (!gst_mfxdec_negotiate_configured (mfxdec))
+    return;
+  mfxdec->configured_early = FALSE;
+
+  if (GST_MFX_PLUGIN_BASE (mfxdec)->srcpad_caps_is_raw
+      && !gst_mfx_decoder_start (mfxdec->decoder))
+    GST_WARNING_OBJECT (mfxdec, "Early decoder initialization failed");
+}
+
 static void
 gst_mfxdec_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
@@ -318,6 +366,17 @@ gst_mfxdec_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_SKIP_CORRUPTED_FRAMES:
       g_value_set_boolean (value, dec->skip_corrupted_frames);
       break;
+    case PROP_DEVICE_BUSY_RETRIES:
+    case PROP_DEVICE_BUSY_TIME:{
+      guint64 retries = 0, busy_time = 0;
+
+      if (dec->decoder)
+        gst_mfx_decoder_get_device_busy_stats (dec->decoder, &retries,
+            &busy_time);
+      g_value_set_uint64 (value,
+          prop_id == PROP_DEVICE_BUSY_RETRIES ? retries : busy_time);
+      break;
+    }
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -332,18 +391,33 @@ gst_mfxdec_create (GstMfxDec * mfxdec, GstCaps * caps)
   GstVideoInfo info;
   GstObject *parent;
   gboolean should_overallocate = FALSE;
+  gboolean packetized = FALSE, headers_in_band = FALSE;
   GByteArray *extradata = NULL;
 
   GstStructure *structure = gst_caps_get_structure (caps, 0);
   if (structure) {
+    const gchar *stream_format;
     const GValue *v_codec_data;
     GstMapInfo minfo;
+
+    stream_format = gst_structure_get_string (structure, "stream-format");
+    if (stream_format) {
+      headers_in_band = !strcmp (stream_format, "avc3")
+          || !strcmp (stream_format, "hev1");
+      packetized = headers_in_band || !strcmp (stream_format, "avc")
+          || !strcmp (stream_format, "hvc1");
+    }
+
     v_codec_data = gst_structure_get_value (structure, "codec_data");
     if (v_codec_data) {
       GstBuffer *codec_data = gst_value_get_buffer (v_codec_data);
       gst_buffer_map (codec_data, &minfo, GST_MAP_READ);
       extradata = g_byte_array_new_take (minfo.data, minfo.size);
       gst_buffer_unmap (codec_data, &minfo);
+    } else if (packetized && !headers_in_band) {
+      GST_ERROR_OBJECT (mfxdec, "Missing codec_data for stream-format %s",
+          stream_format);
+      return FALSE;
     }
   }
 
@@ -372,6 +446,12 @@ gst_mfxdec_create (GstMfxDec * mfxdec, GstCaps * caps)
   if (!mfxdec->decoder)
     return FALSE;
 
+  if (packetized
+      && !gst_mfx_decoder_set_packetized (mfxdec->decoder, headers_in_band)) {
+    gst_mfx_decoder_replace (&mfxdec->decoder, NULL);
+    return FALSE;
+  }
+
   gst_mfx_decoder_update_video_info (mfxdec->decoder, &info);
 
   if (mfxdec->skip_corrupted_frames)
@@ -487,7 +567,11 @@ gst_mfxdec_reset_full (GstMfxDec * mfxdec, GstCaps * caps, gboolean need_reset)
     return TRUE;
   }
   gst_mfx_decoder_replace (&mfxdec->decoder, NULL);
-  return gst_mfxdec_create (mfxdec, caps);
+  if (!gst_mfxdec_create (mfxdec, caps))
+    return FALSE;
+
+  gst_mfxdec_configure_early (mfxdec);
+  return TRUE;
 }
 
 static void
@@ -569,6 +653,13 @@ gst_mfxdec_handle_frame (GstVideoDecoder * vdec, GstVideoCodecFrame * frame)
       GST_TIME_ARGS (frame->dts),
       GST_TIME_ARGS (frame->pts), GST_TIME_ARGS (frame->duration));
 
+  /* Early configuration could not negotiate at the time */
+  if (mfxdec->configured_early) {
+    if (!gst_mfxdec_negotiate_configured (mfxdec))
+      goto not_negotiated;
+    mfxdec->configured_early = FALSE;
+  }
+
   sts = gst_mfx_decoder_decode (mfxdec->decoder, frame);
 
   gst_mfxdec_flush_discarded_frames (mfxdec);
@@ -587,12 +678,8 @@ gst_mfxdec_handle_frame (GstVideoDecoder * vdec, GstVideoCodecFrame * frame)
       }
       break;
     case GST_MFX_DECODER_STATUS_CONFIGURED:
-      if (!gst_mfxdec_negotiate (mfxdec))
+      if (!gst_mfxdec_negotiate_configured (mfxdec))
         goto not_negotiated;
-      /* Final check to determine if system or video memory should be used for
-       * the output of the decoder */
-      gst_mfx_decoder_set_output_memtype (mfxdec->decoder,
-          GST_MFX_PLUGIN_BASE (mfxdec)->srcpad_caps_is_raw);
     case GST_MFX_DECODER_STATUS_ERROR_MORE_DATA:
       ret = GST_VIDEO_DECODER_FLOW_NEED_DATA;
       break;
@@ -731,6 +818,18 @@ gst_mfxdec_class_init (GstMfxDecClass * klass)
           "Skip decoded frames that have major corruption",
           FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_DEVICE_BUSY_RETRIES,
+      g_param_spec_uint64 ("device-busy-retries",
+          "Device busy retries",
+          "Number of decode submissions retried on a busy device",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_DEVICE_BUSY_TIME,
+      g_param_spec_uint64 ("device-busy-time",
+          "Device busy time",
+          "Time in microseconds spent waiting on a busy device",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
   vdec_class->open = GST_DEBUG_FUNCPTR (gst_mfxdec_open);
   vdec_class->close = GST_DEBUG_FUNCPTR (gst_mfxdec_close);
   vdec_class->flush = GST_DEBUG_FUNCPTR (gst_mfxdec_flush);
@@ -861,7 +960,7 @@ gst_mfxdec_register (GstPlugin * plugin, mfxU16 platform)
             mfx_codec_map[i].caps_str = "video/x-h265, "
                 "alignment = (string) au, "
                 "profile = (string) main, "
-                "stream-format = (string) byte-stream";
+                "stream-format = (string) { byte-stream, hvc1, hev1 }";
             rank = GST_RANK_PRIMARY + 3;
           }
           break;
@@ -874,7 +973,7 @@ gst_mfxdec_register (GstPlugin * plugin, mfxU16 platform)
           mfx_codec_map[i].caps_str = "video/x-h265, "
               "alignment = (string) au, "
               "profile = (string) { main, main-10 }, "
-              "stream-format = (string) byte-stream";
+              "stream-format = (string) { byte-stream, hvc1, hev1 }";
           rank = GST_RANK_PRIMARY + 3;
         }
       }
@@ -45,6 +45,7 @@ struct _GstMfxDec
 
   GstVideoCodecState *input_state;
   volatile gboolean need_renegotiation;
+  gboolean configured_early;
 };
 
 struct _GstMfxDecClass
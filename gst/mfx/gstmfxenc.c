@@ -42,6 +42,11 @@ enum
 {
   PROP_0,
 
+  PROP_UPLOAD_THREADS,
+  PROP_DEVICE_BUSY_RETRIES,
+  PROP_DEVICE_BUSY_TIME,
+  PROP_RECONFIGURE_COUNT,
+  PROP_RECONFIGURE_LATENCY,
   PROP_BASE,
 };
 
@@ -139,14 +144,58 @@ prop_value_lookup (GstMfxEnc * encode, guint prop_id)
   return NULL;
 }
 
+/* Properties that can be changed on a running encoder */
+static gboolean
+is_rate_control_property (GstMfxEncoderProp id)
+{
+  switch (id) {
+    case GST_MFX_ENCODER_PROP_BITRATE:
+    case GST_MFX_ENCODER_PROP_VBV_MAX_BITRATE:
+    case GST_MFX_ENCODER_PROP_GOP_SIZE:
+    case GST_MFX_ENCODER_PROP_QUANTIZER:
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
 static gboolean
 gst_mfxenc_default_get_property (GstMfxEnc * encode, guint prop_id,
     GValue * value)
 {
   PropValue *const prop_value = prop_value_lookup (encode, prop_id);
 
+  if (prop_id == PROP_UPLOAD_THREADS) {
+    g_value_set_uint (value, GST_MFX_PLUGIN_BASE (encode)->upload_threads);
+    return TRUE;
+  }
+
+  if (prop_id == PROP_DEVICE_BUSY_RETRIES || prop_id == PROP_DEVICE_BUSY_TIME) {
+    guint64 retries = 0, busy_time = 0;
+
+    if (encode->encoder)
+      gst_mfx_encoder_get_device_busy_stats (encode->encoder, &retries,
+          &busy_time);
+    g_value_set_uint64 (value,
+        prop_id == PROP_DEVICE_BUSY_RETRIES ? retries : busy_time);
+    return TRUE;
+  }
+
+  if (prop_id == PROP_RECONFIGURE_COUNT || prop_id == PROP_RECONFIGURE_LATENCY) {
+    guint64 count = 0, latency = 0;
+
+    if (encode->encoder)
+      gst_mfx_encoder_get_reconfigure_stats (encode->encoder, &count, NULL,
+          &latency, NULL);
+    g_value_set_uint64 (value,
+        prop_id == PROP_RECONFIGURE_COUNT ? count : latency);
+    return TRUE;
+  }
+
   if (prop_value) {
+    GST_OBJECT_LOCK (encode);
     g_value_copy (&prop_value->value, value);
+    GST_OBJECT_UNLOCK (encode);
     return TRUE;
   }
   return FALSE;
@@ -158,8 +207,19 @@ gst_mfxenc_default_set_property (GstMfxEnc * encode, guint prop_id,
 {
   PropValue *const prop_value = prop_value_lookup (encode, prop_id);
 
+  if (prop_id == PROP_UPLOAD_THREADS) {
+    GST_MFX_PLUGIN_BASE (encode)->upload_threads = g_value_get_uint (value);
+    return TRUE;
+  }
+
   if (prop_value) {
+    /* Rate control values may be read by the streaming thread meanwhile */
+    GST_OBJECT_LOCK (encode);
     g_value_copy (value, &prop_value->value);
+    GST_OBJECT_UNLOCK (encode);
+    /* Picked up by the streaming thread before the next frame */
+    if (encode->encoder && is_rate_control_property (prop_value->id))
+      g_atomic_int_set (&encode->rate_control_changed, TRUE);
     return TRUE;
   }
   return FALSE;
@@ -290,7 +350,7 @@ static gboolean
 ensure_encoder (GstMfxEnc * encode)
 {
   GstMfxEncClass *klass = GST_MFXENC_GET_CLASS (encode);
-  GstMfxEncoderStatus status;
+  GstMfxEncoderStatus status = GST_MFX_ENCODER_STATUS_SUCCESS;
   GPtrArray *const prop_values = encode->prop_values;
   guint i;
 
@@ -304,13 +364,17 @@ ensure_encoder (GstMfxEnc * encode)
     return FALSE;
 
   if (prop_values) {
+    GST_OBJECT_LOCK (encode);
     for (i = 0; i < prop_values->len; i++) {
       PropValue *const prop_value = g_ptr_array_index (prop_values, i);
       status = gst_mfx_encoder_set_property (encode->encoder, prop_value->id,
           &prop_value->value);
       if (status != GST_MFX_ENCODER_STATUS_SUCCESS)
-        return FALSE;
+        break;
     }
+    GST_OBJECT_UNLOCK (encode);
+    if (status != GST_MFX_ENCODER_STATUS_SUCCESS)
+      return FALSE;
   }
   return TRUE;
 }
@@ -381,6 +445,62 @@ gst_mfxenc_set_format (GstVideoEncoder * venc, GstVideoCodecState * state)
   return TRUE;
 }
 
+static GstFlowReturn gst_mfxenc_finish (GstVideoEncoder * venc);
+
+/* Pushes out the frames encoded with the previous settings, then hands
+ * the new rate control values over to the encoder */
+static GstFlowReturn
+gst_mfxenc_apply_rate_control (GstMfxEnc * encode)
+{
+  GPtrArray *const prop_values = encode->prop_values;
+  GstMfxEncoderStatus status = GST_MFX_ENCODER_STATUS_SUCCESS;
+  GstFlowReturn ret;
+  gint64 start_time;
+  guint i;
+
+  start_time = g_get_monotonic_time ();
+
+  ret = gst_mfxenc_finish (GST_VIDEO_ENCODER_CAST (encode));
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  GST_OBJECT_LOCK (encode);
+  for (i = 0; i < prop_values->len; i++) {
+    PropValue *const prop_value = g_ptr_array_index (prop_values, i);
+
+    if (!is_rate_control_property (prop_value->id))
+      continue;
+    status = gst_mfx_encoder_set_property (encode->encoder, prop_value->id,
+        &prop_value->value);
+    if (status != GST_MFX_ENCODER_STATUS_SUCCESS)
+      break;
+  }
+  GST_OBJECT_UNLOCK (encode);
+  if (status != GST_MFX_ENCODER_STATUS_SUCCESS)
+    goto error_reconfigure;
+
+  status = gst_mfx_encoder_reconfigure_rate_control (encode->encoder);
+  if (status != GST_MFX_ENCODER_STATUS_SUCCESS)
+    goto error_reconfigure;
+
+  /* Parameter sets may have changed along with the settings */
+  if (encode->need_codec_data)
+    encode->input_state_changed = TRUE;
+
+  GST_DEBUG_OBJECT (encode, "rate control changes applied in %"
+      G_GINT64_FORMAT " us including drain",
+      g_get_monotonic_time () - start_time);
+  return GST_FLOW_OK;
+
+  /* ERRORS */
+error_reconfigure:
+  {
+    GST_ELEMENT_ERROR (encode, STREAM, ENCODE, (NULL),
+        ("failed to apply rate control changes (status %d)", status));
+    return GST_FLOW_ERROR;
+  }
+}
+
 static GstFlowReturn
 gst_mfxenc_handle_frame (GstVideoEncoder * venc, GstVideoCodecFrame * frame)
 {
@@ -390,8 +510,16 @@ gst_mfxenc_handle_frame (GstVideoEncoder * venc, GstVideoCodecFrame * frame)
   GstMfxEncoderStatus status;
   GstMfxVideoMeta *meta;
   GstMfxSurface *surface;
+  GstVideoCodecFrame *out_frame;
   GstFlowReturn ret;
-  GstBuffer *buf;
+  GstBuffer *buf = NULL;
+
+  if (g_atomic_int_compare_and_exchange (&encode->rate_control_changed,
+          TRUE, FALSE)) {
+    ret = gst_mfxenc_apply_rate_control (encode);
+    if (ret != GST_FLOW_OK)
+      goto error_buffer_invalid;
+  }
 
   ret = gst_mfx_plugin_base_get_input_buffer (GST_MFX_PLUGIN_BASE (encode),
       frame->input_buffer, &buf);
@@ -419,14 +547,16 @@ gst_mfxenc_handle_frame (GstVideoEncoder * venc, GstVideoCodecFrame * frame)
   status = gst_mfx_encoder_encode (encode->encoder, frame);
   if (status < GST_MFX_ENCODER_STATUS_SUCCESS)
     goto error_encode_frame;
-  else if (status > 0) {
-    gst_video_codec_frame_unref (frame);
-    ret = GST_FLOW_OK;
-    goto done;
-  }
-  ret = gst_mfxenc_push_frame (encode, frame);
+  /* The encoder keeps its own reference to frames still being encoded */
+  gst_video_codec_frame_unref (frame);
 
-done:
+  /* Push out completed frames in submission order */
+  ret = GST_FLOW_OK;
+  while (gst_mfx_encoder_get_frame (encode->encoder, &out_frame)) {
+    ret = gst_mfxenc_push_frame (encode, out_frame);
+    if (GST_FLOW_OK != ret)
+      break;
+  }
   return ret;
   /* ERRORS */
 error_buffer_invalid:
@@ -475,7 +605,7 @@ gst_mfxenc_finish (GstVideoEncoder * venc)
     status = gst_mfx_encoder_flush (encode->encoder, &frame);
     if (GST_MFX_ENCODER_STATUS_SUCCESS != status)
       break;
-    ret = gst_mfxenc_push_frame (encode, gst_video_codec_frame_ref (frame));
+    ret = gst_mfxenc_push_frame (encode, frame);
   } while (GST_FLOW_OK == ret);
 
   return ret;
@@ -588,6 +718,32 @@ gst_mfxenc_class_init_properties (GstMfxEncClass * klass)
   if (!props)
     return FALSE;
 
+  g_object_class_install_property (object_class, PROP_UPLOAD_THREADS,
+      g_param_spec_uint ("upload-threads", "Upload threads",
+          "Number of threads used to upload raw input frames",
+          1, GST_MFX_UPLOAD_THREADS_MAX, GST_MFX_UPLOAD_THREADS_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_DEVICE_BUSY_RETRIES,
+      g_param_spec_uint64 ("device-busy-retries", "Device busy retries",
+          "Number of encode submissions retried on a busy device",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_DEVICE_BUSY_TIME,
+      g_param_spec_uint64 ("device-busy-time", "Device busy time",
+          "Time in microseconds spent waiting on a busy device",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_RECONFIGURE_COUNT,
+      g_param_spec_uint64 ("reconfigure-count", "Reconfigure count",
+          "Number of bitrate, GOP or quantizer changes applied while encoding",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_RECONFIGURE_LATENCY,
+      g_param_spec_uint64 ("reconfigure-latency", "Reconfigure latency",
+          "Time in microseconds the last encoder reconfiguration took",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
   for (i = 0; i < props->len; i++) {
     GstMfxEncoderPropInfo *const prop = g_ptr_array_index (props, i);
     g_object_class_install_property (object_class, PROP_BASE + i, prop->pspec);
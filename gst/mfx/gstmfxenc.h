@@ -59,6 +59,9 @@ struct _GstMfxEnc
   gboolean need_codec_data;
   GstVideoCodecState *output_state;
   GPtrArray *prop_values;
+
+  /* set when rate control properties change while encoding */
+  volatile gint rate_control_changed;
 };
 
 struct _GstMfxEncClass
@@ -24,6 +24,7 @@
 #include "gstmfxenc_h264.h"
 #include "gstmfxpluginutil.h"
 #include "gstmfxvideomemory.h"
+#include "common/gstmfxstartcode.h"
 
 #include <gst-libs/mfx/gstmfxencoder_h264.h>
 
@@ -175,11 +176,10 @@ gst_mfxenc_h264_alloc_encoder (GstMfxEnc * base)
 static guint8 *
 _h264_byte_stream_next_nal (guint8 * buffer, guint32 len, guint32 * nal_size)
 {
-  const guint8 *cur = buffer;
   const guint8 *const end = buffer + len;
   guint8 *nal_start = NULL;
-  guint32 flag = 0xFFFFFFFF;
   guint32 nal_start_len = 0;
+  gsize size, offset;
 
   g_assert (len >= 0 && buffer && nal_size);
   if (len < 3) {
@@ -197,80 +197,111 @@ _h264_byte_stream_next_nal (guint8 * buffer, guint32 len, guint32 * nal_size)
     }
   }
   nal_start = buffer + nal_start_len;
-  cur = nal_start;
+  if (nal_start >= end) {
+    *nal_size = 0;
+    return NULL;
+  }
 
   /*find next nal start position */
-  while (cur < end) {
-    flag = ((flag << 8) | ((*cur++) & 0xFF));
-    if ((flag & 0x00FFFFFF) == 0x00000001) {
-      if (flag == 0x00000001)
-        *nal_size = cur - 4 - nal_start;
-      else
-        *nal_size = cur - 3 - nal_start;
-      break;
-    }
-  }
-  if (cur >= end) {
-    *nal_size = end - nal_start;
-    if (nal_start >= end) {
-      nal_start = NULL;
-    }
-  }
+  size = end - nal_start;
+  offset = gst_mfx_find_start_code (nal_start, size);
+  if (offset > 0 && offset < size && !nal_start[offset - 1])
+    offset--;                   /* 0x00000001 */
+  *nal_size = offset;
   return nal_start;
 }
 
-static gboolean
-_h264_convert_byte_stream_to_avc (GstBuffer * inbuf, GstBuffer ** outbuf_ptr)
+/* Walks the NALs of the access unit in @data, dropping those with a four
+ * byte start code. A start code size of 3 indicates the start of an
+ * encoded picture in MSDK. When @out is set, each kept NAL is written
+ * there preceded by its size. Returns the converted size, or -1 on
+ * error, and the bytes the output runs ahead of the input at most */
+static gssize
+_h264_byte_stream_to_avc (guint8 * data, gsize size, guint8 * out,
+    gsize * max_lead)
 {
-  GstMapInfo info;
+  guint8 *nal_start_code = data, *nal_body;
+  guint8 *const frame_end = data + size;
   guint32 nal_size = 0;
-  guint8 *nal_start_code, *nal_body;
-  guint8 *avc_data = NULL;
-  guint8 *frame_end;
-  GByteArray *avc_bytes = g_byte_array_new ();
-
-  if (!avc_bytes)
-    return FALSE;
-
-  if (!gst_buffer_map (inbuf, &info, GST_MAP_READ))
-    return FALSE;
-
-  nal_start_code = info.data;
-  frame_end = info.data + info.size;
+  gsize written = 0;
 
+  *max_lead = 0;
   while ((frame_end > nal_start_code) &&
       (nal_body = _h264_byte_stream_next_nal (nal_start_code,
               frame_end - nal_start_code, &nal_size)) != NULL) {
     if (!nal_size)
-      goto error;
+      return -1;
 
-    /* A start code size of 3 indicates the start of an
-     * encoded picture in MSDK */
     if (nal_body - nal_start_code == 3) {
-      avc_data = g_malloc (nal_size + 4);
-      if (!avc_data)
-        goto error;
-
-      /* Precede NALU with NALU size */
-      GST_WRITE_UINT32_BE (avc_data, nal_size);
-      memcpy (avc_data + 4, nal_body, nal_size);
-
-      g_byte_array_append (avc_bytes, avc_data, nal_size + 4);
-      g_free (avc_data);
+      if (written + 4 > (gsize) (nal_body - data))
+        *max_lead = MAX (*max_lead, written + 4 - (nal_body - data));
+      if (out) {
+        /* Precede NALU with NALU size */
+        memmove (out + written + 4, nal_body, nal_size);
+        GST_WRITE_UINT32_BE (out + written, nal_size);
+      }
+      written += nal_size + 4;
     }
     nal_start_code = nal_body + nal_size;
   }
+  return written;
+}
+
+/* Converts @inbuf in place when the headroom the encoder leaves in front
+ * of its output absorbs the start codes that grow into sizes, which keeps
+ * the output in the recycled bitstream buffer. Otherwise the kept NALs
+ * are copied once into a new buffer */
+static gboolean
+_h264_convert_byte_stream_to_avc (GstBuffer * inbuf, GstBuffer ** outbuf_ptr)
+{
+  GstMapInfo info, out_info;
+  gsize headroom, lead;
+  gssize out_size;
+  GstBuffer *outbuf;
+
+  if (!gst_buffer_map (inbuf, &info, GST_MAP_READ))
+    return FALSE;
+  out_size = _h264_byte_stream_to_avc (info.data, info.size, NULL, &lead);
   gst_buffer_unmap (inbuf, &info);
 
-  if (avc_bytes->data)
-    *outbuf_ptr = gst_buffer_new_wrapped (avc_bytes->data, avc_bytes->len);
+  if (out_size < 0)
+    return FALSE;
+  if (!out_size)
+    return TRUE;
+
+  gst_buffer_get_sizes (inbuf, &headroom, NULL);
+  if (lead <= headroom && gst_buffer_is_writable (inbuf)) {
+    gst_buffer_resize (inbuf, -(gssize) lead, -1);
+    if (gst_buffer_map (inbuf, &info, GST_MAP_READWRITE)) {
+      _h264_byte_stream_to_avc (info.data + lead, info.size - lead,
+          info.data, &lead);
+      gst_buffer_unmap (inbuf, &info);
+      gst_buffer_set_size (inbuf, out_size);
+      return TRUE;
+    }
+    gst_buffer_resize (inbuf, lead, -1);
+  }
+
+  outbuf = gst_buffer_new_allocate (NULL, out_size, NULL);
+  if (!outbuf)
+    return FALSE;
+  if (!gst_buffer_map (inbuf, &info, GST_MAP_READ))
+    goto error;
+  if (!gst_buffer_map (outbuf, &out_info, GST_MAP_WRITE)) {
+    gst_buffer_unmap (inbuf, &info);
+    goto error;
+  }
+
+  /* memmove () between distinct buffers is a plain copy */
+  _h264_byte_stream_to_avc (info.data, info.size, out_info.data, &lead);
+  gst_buffer_unmap (outbuf, &out_info);
+  gst_buffer_unmap (inbuf, &info);
 
-  g_byte_array_free (avc_bytes, FALSE);
+  *outbuf_ptr = outbuf;
   return TRUE;
 
 error:
-  g_byte_array_free (avc_bytes, TRUE);
-  gst_buffer_unmap (inbuf, &info);
+  gst_buffer_unref (outbuf);
   return FALSE;
 }
 
@@ -22,12 +22,14 @@
 
 #include <gst/base/gstpushsrc.h>
 #include <gst/allocators/allocators.h>
+#include <sys/stat.h>
 
 #include "gstmfxpluginbase.h"
 #include "gstmfxpluginutil.h"
 #include "gstmfxvideocontext.h"
 #include "gstmfxvideometa.h"
 #include "gstmfxvideobufferpool.h"
+#include "common/gstmfxcopy.h"
 
 #define DEBUG 1
 #include "gstmfxdebug.h"
@@ -141,36 +143,228 @@ is_dma_buffer (GstBuffer * buf)
   return TRUE;
 }
 
+/* Imported dmabufs are cached by identity so that the VA surfaces created
+ * for the small set of buffers cycled by a producer get reused. Entries
+ * live as long as the producer buffer pool they came from */
+typedef struct _DmabufImportKey DmabufImportKey;
+struct _DmabufImportKey
+{
+  dev_t dev[GST_VIDEO_MAX_PLANES];
+  ino_t ino[GST_VIDEO_MAX_PLANES];
+  gsize offset[GST_VIDEO_MAX_PLANES];
+  gint stride[GST_VIDEO_MAX_PLANES];
+  gsize size;
+  GstVideoFormat format;
+  gint width;
+  gint height;
+};
+
+typedef struct _DmabufImport DmabufImport;
+struct _DmabufImport
+{
+  DmabufImportKey key;
+  GstBufferPool *pool;
+  GstMfxSurface *surface;
+};
+
+static guint
+dmabuf_import_key_hash (gconstpointer data)
+{
+  const DmabufImportKey *const key = data;
+
+  return (guint) key->ino[0] ^ ((guint) key->offset[0] << 7) ^
+      (guint) key->size;
+}
+
+static gboolean
+dmabuf_import_key_equal (gconstpointer a, gconstpointer b)
+{
+  return memcmp (a, b, sizeof (DmabufImportKey)) == 0;
+}
+
+static void
+dmabuf_import_free (DmabufImport * import)
+{
+  gst_mfx_surface_unref (import->surface);
+  g_slice_free (DmabufImport, import);
+}
+
+static gboolean
+dmabuf_import_has_pool (gpointer key, gpointer value, gpointer pool)
+{
+  return ((DmabufImport *) value)->pool == pool;
+}
+
+static void
+dmabuf_pool_gone (gpointer data, GObject * where_the_pool_was)
+{
+  GstMfxPluginBase *const plugin = data;
+
+  g_mutex_lock (&plugin->dmabuf_lock);
+  g_hash_table_foreach_remove (plugin->dmabuf_imports,
+      dmabuf_import_has_pool, where_the_pool_was);
+  g_hash_table_remove (plugin->dmabuf_pools, where_the_pool_was);
+  g_mutex_unlock (&plugin->dmabuf_lock);
+}
+
+static void
+dmabuf_pool_unwatch (gpointer pool, gpointer value, gpointer plugin)
+{
+  g_object_weak_unref (pool, dmabuf_pool_gone, plugin);
+}
+
+static void
+clear_dmabuf_imports (GstMfxPluginBase * plugin)
+{
+  g_mutex_lock (&plugin->dmabuf_lock);
+  if (plugin->dmabuf_pools) {
+    g_hash_table_foreach (plugin->dmabuf_pools, dmabuf_pool_unwatch, plugin);
+    g_hash_table_remove_all (plugin->dmabuf_pools);
+  }
+  if (plugin->dmabuf_imports)
+    g_hash_table_remove_all (plugin->dmabuf_imports);
+  g_mutex_unlock (&plugin->dmabuf_lock);
+}
+
+static gboolean
+dmabuf_import_key_init (GstMfxPluginBase * plugin, GstBuffer * buf,
+    const gint fds[], const gsize offsets[], const gint strides[],
+    DmabufImportKey * key)
+{
+  struct stat st;
+  guint i;
+
+  memset (key, 0, sizeof (*key));
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (&plugin->sinkpad_info); i++) {
+    if (i == 0 || fds[i] != fds[i - 1]) {
+      if (fstat (fds[i], &st) < 0)
+        return FALSE;
+    }
+    key->dev[i] = st.st_dev;
+    key->ino[i] = st.st_ino;
+    key->offset[i] = offsets[i];
+    key->stride[i] = strides[i];
+  }
+  key->size = gst_buffer_get_size (buf);
+  key->format = GST_VIDEO_INFO_FORMAT (&plugin->sinkpad_info);
+  key->width = GST_VIDEO_INFO_WIDTH (&plugin->sinkpad_info);
+  key->height = GST_VIDEO_INFO_HEIGHT (&plugin->sinkpad_info);
+  return TRUE;
+}
+
+static GstMfxSurface *
+lookup_dmabuf_import (GstMfxPluginBase * plugin, const DmabufImportKey * key)
+{
+  DmabufImport *import;
+  GstMfxSurface *surface = NULL;
+
+  g_mutex_lock (&plugin->dmabuf_lock);
+  if (plugin->dmabuf_imports) {
+    import = g_hash_table_lookup (plugin->dmabuf_imports, key);
+    if (import)
+      surface = gst_mfx_surface_ref (import->surface);
+  }
+  g_mutex_unlock (&plugin->dmabuf_lock);
+  return surface;
+}
+
+static void
+cache_dmabuf_import (GstMfxPluginBase * plugin, const DmabufImportKey * key,
+    GstBufferPool * pool, GstMfxSurface * surface)
+{
+  DmabufImport *import;
+
+  import = g_slice_new (DmabufImport);
+  import->key = *key;
+  import->pool = pool;
+  import->surface = gst_mfx_surface_ref (surface);
+
+  g_mutex_lock (&plugin->dmabuf_lock);
+  if (!plugin->dmabuf_imports) {
+    plugin->dmabuf_imports = g_hash_table_new_full (dmabuf_import_key_hash,
+        dmabuf_import_key_equal, NULL, (GDestroyNotify) dmabuf_import_free);
+    plugin->dmabuf_pools = g_hash_table_new (g_direct_hash, g_direct_equal);
+  }
+  if (!g_hash_table_contains (plugin->dmabuf_pools, pool)) {
+    g_object_weak_ref (G_OBJECT (pool), dmabuf_pool_gone, plugin);
+    g_hash_table_add (plugin->dmabuf_pools, pool);
+  }
+  g_hash_table_replace (plugin->dmabuf_imports, &import->key, import);
+  g_mutex_unlock (&plugin->dmabuf_lock);
+}
+
+/* Locates each plane in the dmabuf memories of @buf, honouring the
+ * offsets and strides of its GstVideoMeta if any */
+static gboolean
+get_dmabuf_planes (GstMfxPluginBase * plugin, GstBuffer * buf,
+    gint fds[], gsize offsets[], gint strides[])
+{
+  const GstVideoInfo *const vi = &plugin->sinkpad_info;
+  GstVideoMeta *const vmeta = gst_buffer_get_video_meta (buf);
+  GstMemory *mem;
+  gsize offset, skip;
+  guint i, idx, len;
+
+  if (vmeta && vmeta->n_planes != GST_VIDEO_INFO_N_PLANES (vi))
+    return FALSE;
+
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (vi); i++) {
+    offset = vmeta ? vmeta->offset[i] : GST_VIDEO_INFO_PLANE_OFFSET (vi, i);
+    strides[i] = vmeta ? vmeta->stride[i] : GST_VIDEO_INFO_PLANE_STRIDE (vi, i);
+
+    if (!gst_buffer_find_memory (buf, offset, 1, &idx, &len, &skip))
+      return FALSE;
+
+    mem = gst_buffer_peek_memory (buf, idx);
+    if (!gst_is_dmabuf_memory (mem))
+      return FALSE;
+
+    fds[i] = gst_dmabuf_memory_get_fd (mem);
+    if (fds[i] < 0)
+      return FALSE;
+    offsets[i] = mem->offset + skip;
+  }
+  return TRUE;
+}
+
 static gboolean
 plugin_bind_dma_to_mfx_buffer (GstMfxPluginBase * plugin,
 		    GstBuffer * inbuf, GstBuffer * outbuf)
 {
-  GstVideoInfo *info;
   GstMfxVideoMeta *meta;
   GstMfxSurface *surface;
   GstMfxContext *context;
-  gint fd;
+  DmabufImportKey key;
+  gboolean cacheable;
+  gint fds[GST_VIDEO_MAX_PLANES], strides[GST_VIDEO_MAX_PLANES];
+  gsize offsets[GST_VIDEO_MAX_PLANES];
 
-  fd = gst_dmabuf_memory_get_fd (gst_buffer_peek_memory (inbuf, 0));
-  if (fd < 0)
+  if (!get_dmabuf_planes (plugin, inbuf, fds, offsets, strides))
     return FALSE;
 
-  context = gst_mfx_task_aggregator_get_context(plugin->aggregator);
-
   meta = gst_buffer_get_mfx_video_meta (outbuf);
   g_return_val_if_fail (meta != NULL, FALSE);
 
-  info = gst_video_info_copy(&plugin->sinkpad_info);
+  /* Only buffers recycled by a pool come back with the same dmabuf */
+  cacheable = inbuf->pool
+      && dmabuf_import_key_init (plugin, inbuf, fds, offsets, strides, &key);
 
-  /* Check for a VASurface cached in the buffer */
-  surface =
-   gst_mfx_surface_vaapi_new_with_dma_buf_handle (context, fd, info);
-  if (!surface)
-    goto error_create_surface;
+  surface = cacheable ? lookup_dmabuf_import (plugin, &key) : NULL;
+  if (!surface) {
+    context = gst_mfx_task_aggregator_get_context (plugin->aggregator);
+    surface = gst_mfx_surface_vaapi_new_with_dma_buf_planes (context,
+        &plugin->sinkpad_info, fds, offsets, strides);
+    gst_mfx_context_unref (context);
+    if (!surface)
+      goto error_create_surface;
+
+    if (cacheable)
+      cache_dmabuf_import (plugin, &key, inbuf->pool, surface);
+  }
 
-  gst_mfx_video_meta_set_surface(meta, surface);
+  gst_mfx_video_meta_set_surface (meta, surface);
+  gst_mfx_surface_unref (surface);
   gst_buffer_set_mfx_video_meta (inbuf, meta);
-  gst_video_info_free(info);
   gst_buffer_add_parent_buffer_meta (outbuf, inbuf);
   return TRUE;
 
@@ -269,6 +463,11 @@ gst_mfx_plugin_base_init (GstMfxPluginBase * plugin,
     GstDebugCategory * debug_category)
 {
   plugin->debug_category = debug_category;
+  plugin->upload_threads = GST_MFX_UPLOAD_THREADS_DEFAULT;
+  g_queue_init (&plugin->wrapped_surfaces);
+#ifdef WITH_LIBVA_BACKEND
+  g_mutex_init (&plugin->dmabuf_lock);
+#endif
 
   GST_DEBUG_CATEGORY_INIT (debug_category, "mfxpluginbase", 0, "MFX Context");
 
@@ -286,6 +485,13 @@ void
 gst_mfx_plugin_base_finalize (GstMfxPluginBase * plugin)
 {
   gst_mfx_plugin_base_close (plugin);
+#ifdef WITH_LIBVA_BACKEND
+  if (plugin->dmabuf_imports) {
+    g_hash_table_unref (plugin->dmabuf_imports);
+    g_hash_table_unref (plugin->dmabuf_pools);
+  }
+  g_mutex_clear (&plugin->dmabuf_lock);
+#endif
   if (plugin->sinkpad)
     gst_object_unref (plugin->sinkpad);
   if (plugin->srcpad)
@@ -319,6 +525,13 @@ gst_mfx_plugin_base_close (GstMfxPluginBase * plugin)
 
   gst_mfx_task_aggregator_replace (&plugin->aggregator, NULL);
 
+  g_queue_foreach (&plugin->wrapped_surfaces, (GFunc) gst_mfx_surface_unref,
+      NULL);
+  g_queue_clear (&plugin->wrapped_surfaces);
+#ifdef WITH_LIBVA_BACKEND
+  clear_dmabuf_imports (plugin);
+#endif
+
   gst_caps_replace (&plugin->sinkpad_caps, NULL);
   plugin->sinkpad_caps_changed = FALSE;
   gst_video_info_init (&plugin->sinkpad_info);
@@ -703,6 +916,182 @@ config_failed:
   }
 }
 
+/* Raw input uploads may be split in row bands across a worker pool
+ * shared by all elements of the plugin */
+typedef struct _UploadJob UploadJob;
+struct _UploadJob
+{
+  GstVideoFrame *src_frame;
+  GstVideoFrame *dst_frame;
+  guint num_bands;
+  guint pending;
+  GMutex lock;
+  GCond cond;
+};
+
+typedef struct _UploadBand UploadBand;
+struct _UploadBand
+{
+  UploadJob *job;
+  guint index;
+};
+
+static void
+upload_band (UploadJob * job, guint index)
+{
+  GstVideoFrame *const src = job->src_frame;
+  GstVideoFrame *const dst = job->dst_frame;
+  guint i, first, last, row_size, src_stride, dst_stride;
+
+  for (i = 0; i < GST_VIDEO_FRAME_N_PLANES (dst); i++) {
+    const guint plane_height = GST_VIDEO_FRAME_COMP_HEIGHT (dst, i);
+
+    /* Same component-to-plane assumption as gst_video_frame_copy_plane () */
+    row_size = GST_VIDEO_FRAME_COMP_WIDTH (dst, i) *
+        GST_VIDEO_FRAME_COMP_PSTRIDE (dst, i);
+    first = plane_height * index / job->num_bands;
+    last = plane_height * (index + 1) / job->num_bands;
+
+    src_stride = GST_VIDEO_FRAME_PLANE_STRIDE (src, i);
+    dst_stride = GST_VIDEO_FRAME_PLANE_STRIDE (dst, i);
+    gst_mfx_copy_plane_memcpy (
+        (guint8 *) GST_VIDEO_FRAME_PLANE_DATA (dst, i) + first * dst_stride,
+        dst_stride,
+        (guint8 *) GST_VIDEO_FRAME_PLANE_DATA (src, i) + first * src_stride,
+        src_stride, MIN (row_size, MIN (src_stride, dst_stride)),
+        last - first);
+  }
+}
+
+static void
+upload_worker (gpointer data, gpointer user_data)
+{
+  UploadBand *const band = data;
+  UploadJob *const job = band->job;
+
+  upload_band (job, band->index);
+
+  g_mutex_lock (&job->lock);
+  if (--job->pending == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->lock);
+}
+
+static gpointer
+upload_pool_create (gpointer data)
+{
+  return g_thread_pool_new (upload_worker, NULL,
+      MIN (g_get_num_processors (), GST_MFX_UPLOAD_THREADS_MAX),
+      FALSE, NULL);
+}
+
+static GThreadPool *
+get_upload_pool (void)
+{
+  static GOnce once = G_ONCE_INIT;
+
+  g_once (&once, upload_pool_create, NULL);
+  return once.retval;
+}
+
+static gboolean
+upload_frame (GstMfxPluginBase * plugin, GstVideoFrame * dst_frame,
+    GstVideoFrame * src_frame)
+{
+  const GstVideoFormatInfo *const finfo = dst_frame->info.finfo;
+  UploadBand bands[GST_MFX_UPLOAD_THREADS_MAX];
+  GThreadPool *pool;
+  UploadJob job;
+  guint i;
+
+  job.num_bands = MIN (plugin->upload_threads,
+      GST_VIDEO_FRAME_HEIGHT (dst_frame) / 16);
+  if (job.num_bands < 2 || GST_VIDEO_FORMAT_INFO_IS_TILED (finfo)
+      || GST_VIDEO_FORMAT_INFO_HAS_PALETTE (finfo))
+    return gst_video_frame_copy (dst_frame, src_frame);
+
+  pool = get_upload_pool ();
+  if (!pool)
+    return gst_video_frame_copy (dst_frame, src_frame);
+
+  job.src_frame = src_frame;
+  job.dst_frame = dst_frame;
+  job.pending = job.num_bands - 1;
+  g_mutex_init (&job.lock);
+  g_cond_init (&job.cond);
+
+  for (i = 1; i < job.num_bands; i++) {
+    bands[i].job = &job;
+    bands[i].index = i;
+    g_thread_pool_push (pool, &bands[i], NULL);
+  }
+  upload_band (&job, 0);
+
+  g_mutex_lock (&job.lock);
+  while (job.pending > 0)
+    g_cond_wait (&job.cond, &job.lock);
+  g_mutex_unlock (&job.lock);
+
+  g_cond_clear (&job.cond);
+  g_mutex_clear (&job.lock);
+  return TRUE;
+}
+
+static void
+release_wrapped_surfaces (GstMfxPluginBase * plugin)
+{
+  GList *l, *next;
+
+  for (l = plugin->wrapped_surfaces.head; l; l = next) {
+    GstMfxSurface *const surface = l->data;
+
+    next = l->next;
+    if (!gst_mfx_surface_get_frame_surface (surface)->Data.Locked) {
+      g_queue_delete_link (&plugin->wrapped_surfaces, l);
+      gst_mfx_surface_unref (surface);
+    }
+  }
+}
+
+/* Hands raw input over to MSDK in place when its layout allows it. The
+ * surface is kept until MSDK no longer locks it, even if the frame it
+ * came with is gone by then */
+static GstBuffer *
+wrap_input_buffer (GstMfxPluginBase * plugin, GstBuffer * inbuf)
+{
+  GstMfxVideoMeta *meta;
+  GstMfxSurface *surface;
+  GstVideoFrame frame;
+  GstBuffer *outbuf;
+
+  if (gst_buffer_n_memory (inbuf) != 1)
+    return NULL;
+
+  if (!gst_video_frame_map (&frame, &plugin->sinkpad_info, inbuf,
+          GST_MAP_READ))
+    return NULL;
+
+  surface = gst_mfx_surface_new_wrapped (&frame);
+  if (!surface) {
+    gst_video_frame_unmap (&frame);
+    return NULL;
+  }
+
+  meta = gst_mfx_video_meta_new ();
+  if (!meta) {
+    gst_mfx_surface_unref (surface);
+    return NULL;
+  }
+  gst_mfx_video_meta_set_surface (meta, surface);
+
+  outbuf = gst_buffer_new ();
+  gst_buffer_set_mfx_video_meta (outbuf, meta);
+  gst_mfx_video_meta_unref (meta);
+
+  g_queue_push_tail (&plugin->wrapped_surfaces, surface);
+  return outbuf;
+}
+
 /**
  * gst_mfx_plugin_base_get_input_buffer:
  * @plugin: a #GstMfxPluginBase
@@ -737,6 +1126,17 @@ gst_mfx_plugin_base_get_input_buffer (GstMfxPluginBase * plugin,
   if (!plugin->sinkpad_caps_is_raw)
     goto error_invalid_buffer;
 
+  release_wrapped_surfaces (plugin);
+
+#ifdef WITH_LIBVA_BACKEND
+  if (!is_dma_buffer (inbuf))
+#endif
+  {
+    outbuf = wrap_input_buffer (plugin, inbuf);
+    if (outbuf)
+      goto done;
+  }
+
   if (!plugin->sinkpad_buffer_pool)
     goto error_no_pool;
 
@@ -769,7 +1169,7 @@ gst_mfx_plugin_base_get_input_buffer (GstMfxPluginBase * plugin,
   GST_VIDEO_FRAME_WIDTH (&src_frame) = GST_VIDEO_FRAME_WIDTH (&out_frame);
   GST_VIDEO_FRAME_HEIGHT (&src_frame) = GST_VIDEO_FRAME_HEIGHT (&out_frame);
 
-  success = gst_video_frame_copy (&out_frame, &src_frame);
+  success = upload_frame (plugin, &out_frame, &src_frame);
   gst_video_frame_unmap (&out_frame);
   gst_video_frame_unmap (&src_frame);
   if (!success)
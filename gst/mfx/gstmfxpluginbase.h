@@ -99,6 +99,9 @@ typedef struct _GstMfxPluginBaseClass GstMfxPluginBaseClass;
 #define GST_MFX_PLUGIN_BASE_AGGREGATOR(plugin) \
     (GST_MFX_PLUGIN_BASE(plugin)->aggregator)
 
+#define GST_MFX_UPLOAD_THREADS_DEFAULT  1
+#define GST_MFX_UPLOAD_THREADS_MAX      16
+
 struct _GstMfxPluginBase
 {
   /*< private > */
@@ -131,6 +134,14 @@ struct _GstMfxPluginBase
   gboolean sinkpad_has_dmabuf;
   gboolean can_export_gl_textures;
   gboolean has_ext_dmabuf; //For DMABuf Import
+#ifdef WITH_LIBVA_BACKEND
+  GMutex dmabuf_lock;
+  GHashTable *dmabuf_imports;
+  GHashTable *dmabuf_pools;
+#endif
+  guint upload_threads;
+  /* Wrapped input surfaces that MSDK may still be reading from */
+  GQueue wrapped_surfaces;
 
 #ifdef HAVE_GST_GL_LIBS
   GstGLContext *gl_context;
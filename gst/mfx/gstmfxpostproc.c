@@ -101,6 +101,9 @@ enum
 #endif // MSDK_CHECK_VERSION
   PROP_FRAMERATE,
   PROP_FRC_ALGORITHM,
+  PROP_UPLOAD_THREADS,
+  PROP_DEVICE_BUSY_RETRIES,
+  PROP_DEVICE_BUSY_TIME,
 };
 
 #define DEFAULT_ASYNC_DEPTH             0
@@ -1229,6 +1232,9 @@ gst_mfxpostproc_set_property (GObject * object,
     case PROP_FRC_ALGORITHM:
       vpp->alg = g_value_get_enum (value);
       break;
+    case PROP_UPLOAD_THREADS:
+      GST_MFX_PLUGIN_BASE (vpp)->upload_threads = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1299,6 +1305,20 @@ gst_mfxpostproc_get_property (GObject * object,
     case PROP_FRC_ALGORITHM:
       g_value_set_enum (value, vpp->alg);
       break;
+    case PROP_UPLOAD_THREADS:
+      g_value_set_uint (value, GST_MFX_PLUGIN_BASE (vpp)->upload_threads);
+      break;
+    case PROP_DEVICE_BUSY_RETRIES:
+    case PROP_DEVICE_BUSY_TIME:{
+      guint64 retries = 0, busy_time = 0;
+
+      if (vpp->filter)
+        gst_mfx_filter_get_device_busy_stats (vpp->filter, &retries,
+            &busy_time);
+      g_value_set_uint64 (value,
+          prop_id == PROP_DEVICE_BUSY_RETRIES ? retries : busy_time);
+      break;
+    }
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -1575,6 +1595,37 @@ gst_mfxpostproc_class_init (GstMfxPostprocClass * klass)
           "The algorithm type",
           GST_MFX_TYPE_FRC_ALGORITHM,
           DEFAULT_FRC_ALG, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstMfxPostproc: upload-threads
+   * Number of threads copying raw system memory input into video surfaces.
+   */
+  g_object_class_install_property (object_class,
+      PROP_UPLOAD_THREADS,
+      g_param_spec_uint ("upload-threads", "Upload threads",
+          "Number of threads used to upload raw input frames",
+          1, GST_MFX_UPLOAD_THREADS_MAX, GST_MFX_UPLOAD_THREADS_DEFAULT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstMfxPostproc: device-busy-retries
+   * Number of VPP submissions retried because the device was busy.
+   */
+  g_object_class_install_property (object_class,
+      PROP_DEVICE_BUSY_RETRIES,
+      g_param_spec_uint64 ("device-busy-retries", "Device busy retries",
+          "Number of VPP submissions retried on a busy device",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstMfxPostproc: device-busy-time
+   * Time in microseconds spent waiting for a busy device.
+   */
+  g_object_class_install_property (object_class,
+      PROP_DEVICE_BUSY_TIME,
+      g_param_spec_uint64 ("device-busy-time", "Device busy time",
+          "Time in microseconds spent waiting on a busy device",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -21,6 +21,7 @@
  */
 
 #include "gstmfxvideomemory.h"
+#include "common/gstmfxcopy.h"
 
 GST_DEBUG_CATEGORY_STATIC (gst_debug_mfxvideomemory);
 #define GST_CAT_DEFAULT gst_debug_mfxvideomemory
@@ -28,7 +29,7 @@ GST_DEBUG_CATEGORY_STATIC (gst_debug_mfxvideomemory);
 static gboolean
 copy_image (GstMfxVideoMemory * mem)
 {
-  guint i, j, src_stride, dest_stride, height, offset, num_planes, plane_size;
+  guint i, src_stride, dest_stride, height, offset, num_planes, plane_size;
   guint8 *src_plane = NULL;
 
   guint data_size = GST_VIDEO_INFO_SIZE (mem->image_info);
@@ -51,15 +52,9 @@ copy_image (GstMfxVideoMemory * mem)
     else
       plane_size = data_size - offset;
 
-    if (src_stride != dest_stride) {
-      height = plane_size / dest_stride;
-      for (j = 0; j < height; j++) {
-        memcpy (mem->data + offset, src_plane, dest_stride);
-        src_plane += src_stride;
-        offset += dest_stride;
-      }
-    } else
-      memcpy (mem->data + offset, src_plane, plane_size);
+    height = plane_size / dest_stride;
+    gst_mfx_copy_plane (mem->data + offset, dest_stride, src_plane,
+        src_stride, dest_stride, height);
   }
 
   mem->new_copy = TRUE;
@@ -67,16 +62,29 @@ copy_image (GstMfxVideoMemory * mem)
   return TRUE;
 }
 
+/* The surface memory can only be handed out as is if its layout matches
+ * the strides and offsets of the image info */
 static gboolean
-get_image_data (GstMfxVideoMemory * mem)
+surface_matches_image_info (GstMfxVideoMemory * mem)
 {
-  guint width = GST_VIDEO_INFO_WIDTH (mem->image_info);
-  guint aligned_width = GST_MFX_SURFACE_WIDTH (mem->surface);
-  guint height = GST_VIDEO_INFO_HEIGHT (mem->image_info);
-  guint aligned_height = GST_MFX_SURFACE_HEIGHT (mem->surface);
+  guint8 *const data = gst_mfx_surface_get_plane (mem->surface, 0);
+  guint i;
+
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (mem->image_info); i++) {
+    if (gst_mfx_surface_get_pitch (mem->surface, i) !=
+        GST_VIDEO_INFO_PLANE_STRIDE (mem->image_info, i))
+      return FALSE;
+    if (gst_mfx_surface_get_plane (mem->surface, i) !=
+        data + GST_VIDEO_INFO_PLANE_OFFSET (mem->image_info, i))
+      return FALSE;
+  }
+  return TRUE;
+}
 
-  if ((width == aligned_width && height == aligned_height) ||
-      GST_VIDEO_INFO_N_PLANES (mem->image_info) == 1) {
+static gboolean
+get_image_data (GstMfxVideoMemory * mem)
+{
+  if (surface_matches_image_info (mem)) {
     mem->data = gst_mfx_surface_get_plane (mem->surface, 0);
     mem->new_copy = FALSE;
     return TRUE;
@@ -129,7 +137,7 @@ gst_video_meta_map_mfx_surface (GstVideoMeta * meta, guint plane,
   if (!ensure_surface (mem))
     goto error_ensure_surface;
 
-  if (!gst_mfx_surface_map (mem->surface))
+  if (!gst_mfx_surface_map (mem->surface, flags))
     goto error_map_surface;
 
   *data = gst_mfx_surface_get_plane (mem->surface, plane);
@@ -235,7 +243,7 @@ gst_mfx_video_memory_map (GstMfxVideoMemory * mem, gsize maxsize, guint flags)
       // Only read flag set: return raw pixels
       if (!ensure_surface (mem))
         goto error_no_surface;
-      if (!gst_mfx_surface_map (mem->surface))
+      if (!gst_mfx_surface_map (mem->surface, GST_MAP_READ))
         goto error_map_surface;
 
       mem->map_type = GST_MFX_SYSTEM_MEMORY_MAP_TYPE_LINEAR;
@@ -0,0 +1,91 @@
+/*
+ *  bench-copy.c - plane copy benchmark
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gstmfxcopy.h"
+
+#define DEFAULT_RUNS    100
+
+typedef void (*CopyPlaneFunc) (guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint row_size, guint height);
+
+/* Reads back a 4K NV12 frame from @src, luma then interleaved chroma */
+static void
+copy_frame (CopyPlaneFunc func, guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint width, guint height)
+{
+  func (dst, dst_stride, src, src_stride, width, height);
+  func (dst + (gsize) dst_stride * height, dst_stride,
+      src + (gsize) src_stride * height, src_stride, width, height / 2);
+}
+
+static void
+run (const gchar * name, CopyPlaneFunc func, guint8 * dst, guint dst_stride,
+    const guint8 * src, guint src_stride, guint width, guint height,
+    guint runs)
+{
+  gint64 start, elapsed;
+  guint i;
+
+  copy_frame (func, dst, dst_stride, src, src_stride, width, height);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < runs; i++)
+    copy_frame (func, dst, dst_stride, src, src_stride, width, height);
+  elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+  g_print ("%-10s pitch %u -> %u: %6.3f ms/frame, %6.2f GB/s\n", name,
+      src_stride, dst_stride, (gdouble) elapsed / runs / 1000,
+      (gdouble) width * height * 3 / 2 * runs / elapsed / 1000);
+}
+
+/* The source is plain cached memory here, which shows the overhead of the
+ * streaming load path over memcpy rather than its gain on uncached video
+ * memory mappings */
+int
+main (int argc, char **argv)
+{
+  static const guint pitches[][2] = { {3840, 3840}, {4096, 3840} };
+  const guint width = 3840, height = 2160;
+  guint runs = MAX (argc > 1 ? atoi (argv[1]) : DEFAULT_RUNS, 1);
+  guint8 *src, *dst;
+  guint i;
+
+  src = g_malloc ((gsize) 4096 * height * 3 / 2);
+  dst = g_malloc ((gsize) 4096 * height * 3 / 2);
+  memset (src, 0x80, (gsize) 4096 * height * 3 / 2);
+  memset (dst, 0, (gsize) 4096 * height * 3 / 2);
+
+  g_print ("Copying %ux%u NV12 frames, %u runs, streaming load %s\n",
+      width, height, runs,
+      gst_mfx_copy_has_streaming_load () ? "supported" : "not supported");
+
+  for (i = 0; i < G_N_ELEMENTS (pitches); i++) {
+    run ("memcpy", gst_mfx_copy_plane_memcpy, dst, pitches[i][1], src,
+        pitches[i][0], width, height, runs);
+    run ("copy_plane", gst_mfx_copy_plane, dst, pitches[i][1], src,
+        pitches[i][0], width, height, runs);
+  }
+
+  g_free (src);
+  g_free (dst);
+  return 0;
+}
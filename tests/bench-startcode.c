@@ -0,0 +1,144 @@
+/*
+ *  bench-startcode.c - Annex B start code scanner benchmark
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#include <stdlib.h>
+
+/* Built in, so that the vector scans can be called directly */
+#include "gstmfxstartcode.c"
+
+#define STREAM_SIZE     (32 * 1024 * 1024)
+#define DEFAULT_RUNS    20
+
+/* Slice sizes of a 50+ Mbps stream, with a few parameter set sized NALs */
+#define MIN_NAL_SIZE    16
+#define MAX_NAL_SIZE    (256 * 1024)
+
+/* Fills @data with NAL units of random sizes, each behind a 3 or 4 byte
+ * start code. Payloads are random with emulation prevention applied, so
+ * that the only prefixes are the start codes, as in a real stream */
+static guint
+generate_stream (guint8 * data, gsize size, GRand * rand)
+{
+  gsize pos = 0, end;
+  guint num_nals = 0, zeros;
+
+  while (pos + 4 + MIN_NAL_SIZE <= size) {
+    if (g_rand_boolean (rand))
+      data[pos++] = 0;
+    data[pos++] = 0;
+    data[pos++] = 0;
+    data[pos++] = 1;
+    num_nals++;
+
+    end = pos + g_rand_int_range (rand, MIN_NAL_SIZE, MAX_NAL_SIZE);
+    end = MIN (end, size);
+    /* Compressed data is mostly noise, with runs of zeros here and there */
+    for (zeros = 0; pos < end; pos++) {
+      guint8 byte = g_rand_int_range (rand, 0, 8) ? g_rand_int (rand) : 0;
+
+      if (zeros >= 2 && byte <= 3) {
+        data[pos++] = 3;
+        zeros = 0;
+        if (pos == end)
+          break;
+      }
+      data[pos] = byte;
+      zeros = byte ? 0 : zeros + 1;
+    }
+    /* A NAL unit never ends with a zero byte */
+    if (!data[pos - 1])
+      data[pos - 1] = 0x80;
+  }
+
+  /* Pad with payload that cannot form a prefix */
+  while (pos < size)
+    data[pos++] = 0xff;
+  return num_nals;
+}
+
+static guint
+count_start_codes (FindStartCodeFunc func, const guint8 * data, gsize size)
+{
+  gsize pos = 0;
+  guint count = 0;
+
+  for (;;) {
+    pos += func (data + pos, size - pos);
+    if (pos >= size)
+      break;
+    count++;
+    pos += 3;
+  }
+  return count;
+}
+
+static void
+run (const gchar * name, FindStartCodeFunc func, const guint8 * data,
+    gsize size, guint runs, guint num_nals)
+{
+  gint64 start, elapsed;
+  guint i, count = 0;
+
+  /* Warm up caches and branch predictors */
+  count_start_codes (func, data, size);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < runs; i++)
+    count = count_start_codes (func, data, size);
+  elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+  if (count != num_nals)
+    g_error ("%s scan found %u start codes, expected %u", name, count,
+        num_nals);
+
+  g_print ("%-8s %8.1f MB/s\n", name,
+      (gdouble) size * runs / elapsed * G_USEC_PER_SEC / (1024 * 1024));
+}
+
+int
+main (int argc, char **argv)
+{
+  guint runs = MAX (argc > 1 ? atoi (argv[1]) : DEFAULT_RUNS, 1);
+  GRand *rand = g_rand_new_with_seed (0);
+  guint8 *data = g_malloc (STREAM_SIZE);
+  guint num_nals;
+
+  num_nals = generate_stream (data, STREAM_SIZE, rand);
+  g_print ("Scanning %u MB holding %u NAL units, %u runs\n",
+      STREAM_SIZE / (1024 * 1024), num_nals, runs);
+
+  run ("scalar", gst_mfx_find_start_code_scalar, data, STREAM_SIZE,
+      runs, num_nals);
+#ifdef HAVE_SIMD_SCAN
+  {
+    FindStartCodeFunc best = (FindStartCodeFunc) select_find_start_code (NULL);
+
+    if (best == find_start_code_avx2 || best == find_start_code_sse2)
+      run ("sse2", find_start_code_sse2, data, STREAM_SIZE, runs,
+          num_nals);
+    if (best == find_start_code_avx2)
+      run ("avx2", find_start_code_avx2, data, STREAM_SIZE, runs,
+          num_nals);
+  }
+#endif
+
+  g_free (data);
+  g_rand_free (rand);
+  return 0;
+}
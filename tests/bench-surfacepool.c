@@ -0,0 +1,92 @@
+/*
+ *  bench-surfacepool.c - surface pool benchmark
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#include "sysdeps.h"
+#include "gstmfxsurfacepool.h"
+
+#define DEFAULT_ITERATIONS  1000000
+
+/* Decodes the way MSDK uses the pool: every surface handed out gets
+ * locked, looked up from its frame surface as a decoded output, and
+ * unlocked @depth frames later, after which the pool reclaims it. System
+ * memory surfaces keep the GPU out of the measure. Returns the time
+ * spent per frame in nanoseconds */
+static gdouble
+run (GstMfxSurfacePool * pool, guint depth, guint iterations)
+{
+  GstMfxSurface **in_flight = g_new0 (GstMfxSurface *, depth);
+  GstMfxSurface *surface;
+  mfxFrameSurface1 *surf;
+  gint64 start, elapsed;
+  guint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++) {
+    surface = gst_mfx_surface_pool_get_surface (pool);
+    if (!surface)
+      g_error ("failed to get a surface from the pool");
+
+    surf = gst_mfx_surface_get_frame_surface (surface);
+    surf->Data.Locked++;
+    if (gst_mfx_surface_pool_find_surface (pool, surf) != surface)
+      g_error ("found the wrong surface");
+
+    if (in_flight[i % depth])
+      gst_mfx_surface_get_frame_surface (in_flight[i % depth])->Data.Locked--;
+    in_flight[i % depth] = surface;
+  }
+  elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+  for (i = 0; i < depth; i++)
+    if (in_flight[i])
+      gst_mfx_surface_get_frame_surface (in_flight[i])->Data.Locked--;
+  g_free (in_flight);
+
+  return (gdouble) elapsed * 1000 / iterations;
+}
+
+int
+main (int argc, char **argv)
+{
+  /* Low latency, default and overallocated decodebin async depths */
+  static const guint depths[] = { 1, 4, 16, 26 };
+  guint iterations = DEFAULT_ITERATIONS;
+  GstMfxSurfacePool *pool;
+  GstVideoInfo info;
+  guint i;
+
+  gst_init (&argc, &argv);
+  if (argc > 1)
+    iterations = MAX (atoi (argv[1]), 1);
+
+  gst_video_info_set_format (&info, GST_VIDEO_FORMAT_NV12, 1920, 1080);
+
+  for (i = 0; i < G_N_ELEMENTS (depths); i++) {
+    pool = gst_mfx_surface_pool_new (NULL, &info, TRUE);
+    if (!pool)
+      g_error ("failed to create a system memory surface pool");
+
+    /* Populate the pool before timing */
+    run (pool, depths[i], depths[i] + 1);
+    g_print ("%3u surfaces in flight: %7.1f ns per get / find / put\n",
+        depths[i], run (pool, depths[i], iterations));
+    gst_mfx_surface_pool_unref (pool);
+  }
+  return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ *  test-copy.c - plane copy tests
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include "gstmfxcopy.h"
+
+/* Larger than the 4096 byte bounce buffer of the streaming load path */
+#define MAX_ROW_SIZE    9000
+#define MAX_PAD         17
+
+/* Copies a plane with both functions into destinations filled with the
+ * same garbage, and checks they end up identical, stride padding
+ * included. Source and destination start @src_offset and @dst_offset
+ * bytes, below 16, past a 16 byte boundary */
+static void
+check_copy (guint row_size, guint height, guint src_stride,
+    guint dst_stride, guint src_offset, guint dst_offset)
+{
+  gsize src_size = (gsize) src_stride * (height - 1) + row_size;
+  gsize dst_size = (gsize) dst_stride * (height - 1) + row_size;
+  guint8 *src_mem, *dst_mem, *ref_mem, *src, *dst, *ref;
+  gsize i;
+
+  src_mem = g_malloc (src_size + 32);
+  dst_mem = g_malloc (dst_size + 32);
+  ref_mem = g_malloc (dst_size + 32);
+  src = (guint8 *) (((guintptr) src_mem + 15) & ~15) + src_offset;
+  dst = (guint8 *) (((guintptr) dst_mem + 15) & ~15) + dst_offset;
+  ref = (guint8 *) (((guintptr) ref_mem + 15) & ~15) + dst_offset;
+
+  for (i = 0; i < src_size; i++)
+    src[i] = g_test_rand_int ();
+  for (i = 0; i < dst_size; i++)
+    dst[i] = ref[i] = i * 7;
+
+  gst_mfx_copy_plane (dst, dst_stride, src, src_stride, row_size, height);
+  gst_mfx_copy_plane_memcpy (ref, dst_stride, src, src_stride, row_size,
+      height);
+
+  if (memcmp (dst, ref, dst_size))
+    g_error ("copy of %u rows of %u bytes, strides %u / %u, offsets %u / %u"
+        " differs from memcpy", height, row_size, src_stride, dst_stride,
+        src_offset, dst_offset);
+
+  g_free (src_mem);
+  g_free (dst_mem);
+  g_free (ref_mem);
+}
+
+/* Odd row sizes around the 16 byte vector and 64 byte line sizes, and
+ * past the bounce buffer size */
+static void
+test_row_sizes (void)
+{
+  static const guint sizes[] = { 4095, 4096, 4097, 8191, MAX_ROW_SIZE };
+  guint row_size, i;
+
+  for (row_size = 1; row_size <= 200; row_size++)
+    check_copy (row_size, 3, row_size + 5, row_size + 3, 0, 0);
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    check_copy (sizes[i], 2, sizes[i] + 64, sizes[i] + 1, 0, 0);
+}
+
+/* Every source and destination misalignment */
+static void
+test_unaligned (void)
+{
+  guint src_offset, dst_offset;
+
+  for (src_offset = 0; src_offset < 16; src_offset++)
+    for (dst_offset = 0; dst_offset < 16; dst_offset++) {
+      check_copy (77, 4, 96, 80, src_offset, dst_offset);
+      check_copy (4133, 2, 4160, 4133, src_offset, dst_offset);
+    }
+}
+
+/* Padded pitches on either side, which must be left untouched */
+static void
+test_strides (void)
+{
+  guint pad;
+
+  for (pad = 0; pad <= MAX_PAD; pad++) {
+    check_copy (100, 5, 100 + pad, 100, 0, 0);
+    check_copy (100, 5, 100, 100 + pad, 0, 0);
+    check_copy (1920, 3, 2048, 1920 + pad, 3, 0);
+  }
+}
+
+/* Equal strides without padding collapse the plane into a single row */
+static void
+test_single_row (void)
+{
+  check_copy (64, 32, 64, 64, 0, 0);
+  check_copy (33, 200, 33, 33, 1, 5);
+  check_copy (1920, 1080 / 2, 1920, 1920, 0, 0);
+  check_copy (4097, 1, 4097, 4097, 7, 9);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  if (!gst_mfx_copy_has_streaming_load ())
+    g_test_message ("No streaming load support, testing the memcpy path");
+
+  g_test_add_func ("/copy/row-sizes", test_row_sizes);
+  g_test_add_func ("/copy/unaligned", test_unaligned);
+  g_test_add_func ("/copy/strides", test_strides);
+  g_test_add_func ("/copy/single-row", test_single_row);
+
+  return g_test_run ();
+}
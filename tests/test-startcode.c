@@ -0,0 +1,208 @@
+/*
+ *  test-startcode.c - Annex B start code scanner tests
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public License
+ *  as published by the Free Software Foundation; either version 2.1
+ *  of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free
+ *  Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+/* Built in, so that the vector scans can be called directly */
+#include "gstmfxstartcode.c"
+
+/* Covers two AVX2 blocks plus the scalar tail */
+#define MAX_EDGE_SIZE 80
+
+typedef struct
+{
+  const gchar *name;
+  FindStartCodeFunc func;
+} Scanner;
+
+static Scanner scanners[3];
+static guint num_scanners;
+
+static void
+add_scanner (const gchar * name, FindStartCodeFunc func)
+{
+  scanners[num_scanners].name = name;
+  scanners[num_scanners].func = func;
+  num_scanners++;
+}
+
+static void
+setup_scanners (void)
+{
+  add_scanner ("dispatch", gst_mfx_find_start_code);
+#ifdef HAVE_SIMD_SCAN
+  {
+    FindStartCodeFunc best = (FindStartCodeFunc) select_find_start_code (NULL);
+
+    /* Only what the CPU runs, AVX2 implies SSE2 */
+    if (best == find_start_code_avx2 || best == find_start_code_sse2)
+      add_scanner ("sse2", find_start_code_sse2);
+    if (best == find_start_code_avx2)
+      add_scanner ("avx2", find_start_code_avx2);
+  }
+#endif
+}
+
+/* Walks @data the way the decoder does, resuming one byte past each
+ * prefix found, and checks every scanner stops at the same offsets as
+ * the scalar one */
+static void
+check_scanners (const guint8 * data, gsize size)
+{
+  gsize pos, expected, found;
+  guint i;
+
+  for (pos = 0; pos <= size; pos = expected + 1) {
+    expected = pos + gst_mfx_find_start_code_scalar (data + pos, size - pos);
+
+    for (i = 0; i < num_scanners; i++) {
+      found = pos + scanners[i].func (data + pos, size - pos);
+      if (found != expected)
+        g_error ("%s scan of %" G_GSIZE_FORMAT " bytes from %" G_GSIZE_FORMAT
+            " returned %" G_GSIZE_FORMAT ", expected %" G_GSIZE_FORMAT,
+            scanners[i].name, size, pos, found, expected);
+    }
+  }
+}
+
+/* Scans copies of @src ending exactly at the end of their allocation, so
+ * that reads past the end show up in memory checkers, from two different
+ * alignments */
+static void
+check_buffer (const guint8 * src, gsize size)
+{
+  guint8 *data;
+  guint offset;
+
+  for (offset = 0; offset < 2; offset++) {
+    data = g_malloc (offset + size + 1);
+    memcpy (data + offset + 1, src, size);
+    check_scanners (data + offset + 1, size);
+    g_free (data);
+  }
+}
+
+/* Every buffer of up to 3 bytes made of 00, 01, 02 and ff */
+static void
+test_short_buffers (void)
+{
+  static const guint8 values[] = { 0x00, 0x01, 0x02, 0xff };
+  guint8 data[3];
+  guint size, n, v, i;
+
+  for (size = 0; size <= 3; size++) {
+    guint count = 1;
+
+    for (i = 0; i < size; i++)
+      count *= G_N_ELEMENTS (values);
+
+    for (n = 0; n < count; n++) {
+      for (i = 0, v = n; i < size; i++, v /= G_N_ELEMENTS (values))
+        data[i] = values[v % G_N_ELEMENTS (values)];
+      check_buffer (data, size);
+    }
+  }
+}
+
+/* A single prefix at each position of each buffer size, which moves it
+ * across and straddling the 16 and 32 byte block boundaries */
+static void
+test_block_edges (void)
+{
+  guint8 data[MAX_EDGE_SIZE];
+  gsize size, pos;
+
+  for (size = 3; size <= MAX_EDGE_SIZE; size++) {
+    for (pos = 0; pos + 3 <= size; pos++) {
+      memset (data, 0xff, size);
+      data[pos] = data[pos + 1] = 0;
+      data[pos + 2] = 1;
+      check_buffer (data, size);
+
+      /* Near misses: zero pairs not followed by 01 */
+      data[pos + 2] = 2;
+      check_buffer (data, size);
+      data[pos + 2] = 0;
+      check_buffer (data, size);
+    }
+  }
+}
+
+/* Zero runs trip the zero pair pre-check of every block */
+static void
+test_zero_runs (void)
+{
+  guint8 data[MAX_EDGE_SIZE];
+  gsize size, pos;
+
+  for (size = 0; size <= MAX_EDGE_SIZE; size++) {
+    memset (data, 0, size);
+    check_buffer (data, size);
+
+    /* Four byte start codes and a single 01 anywhere in the run */
+    for (pos = 0; pos < size; pos++) {
+      memset (data, 0, size);
+      data[pos] = 1;
+      check_buffer (data, size);
+    }
+  }
+}
+
+/* Random data biased towards 00 and 01, so that prefixes and near misses
+ * are frequent */
+static void
+test_random (void)
+{
+  guint8 data[1024];
+  guint iter, i, size;
+
+  for (iter = 0; iter < 2000; iter++) {
+    size = g_test_rand_int_range (0, 1024);
+
+    for (i = 0; i < size; i++) {
+      switch (g_test_rand_int_range (0, 4)) {
+        case 0:
+        case 1:
+          data[i] = 0;
+          break;
+        case 2:
+          data[i] = 1;
+          break;
+        default:
+          data[i] = g_test_rand_int_range (0, 256);
+          break;
+      }
+    }
+    check_buffer (data, size);
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+  setup_scanners ();
+
+  g_test_add_func ("/startcode/short", test_short_buffers);
+  g_test_add_func ("/startcode/block-edges", test_block_edges);
+  g_test_add_func ("/startcode/zero-runs", test_zero_runs);
+  g_test_add_func ("/startcode/random", test_random);
+
+  return g_test_run ();
+}